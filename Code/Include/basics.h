@@ -2,8 +2,22 @@
 #include "vec.h"
 #include <time.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
 #include <vector>
 
+#if defined(__AVX2__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
+
 // Random (Dirty, C-style)
 class Random
 {
@@ -41,6 +55,279 @@ public:
 	{
 		return rand();
 	}
+
+	/*!
+	\brief Compute a random integer in [0, n). Two draws are combined when RAND_MAX is smaller than n.
+	*/
+	static inline int Integer(int n)
+	{
+		if (n <= RAND_MAX)
+			return rand() % n;
+		return int(((long long)(rand()) * ((long long)(RAND_MAX) + 1) + rand()) % n);
+	}
+};
+
+// Atomic. Relaxed atomic accesses to the values shared between threads, such as the cells of the fields
+// written by the grain transport. Relaxed loads and stores compile to plain moves on x86 but are not data races.
+// Without std::atomic_ref (before C++20), plain accesses and OpenMP atomics are used instead. The AVX2 gathers cannot
+// be atomic: the flow directions of the cascades gather live cells with plain loads, and the batched height sampler
+// is restricted to frozen fields, see FlowDirectionsAVX2() and ScalarField2DT::GetValueBilinearSum8().
+class Atomic
+{
+public:
+	/*!
+	\brief Relaxed load.
+	*/
+	template <typename T>
+	static inline T Load(const T& x)
+	{
+#if defined(__cpp_lib_atomic_ref)
+		return std::atomic_ref<T>(const_cast<T&>(x)).load(std::memory_order_relaxed);
+#else
+		return x;
+#endif
+	}
+
+	/*!
+	\brief Relaxed store.
+	*/
+	template <typename T>
+	static inline void Store(T& x, T v)
+	{
+#if defined(__cpp_lib_atomic_ref)
+		std::atomic_ref<T>(x).store(v, std::memory_order_relaxed);
+#else
+		x = v;
+#endif
+	}
+
+	/*!
+	\brief Relaxed atomic addition, for integer and floating point types.
+	*/
+	template <typename T>
+	static inline void Add(T& x, T v)
+	{
+#if defined(__cpp_lib_atomic_ref)
+		std::atomic_ref<T>(x).fetch_add(v, std::memory_order_relaxed);
+#else
+#pragma omp atomic
+		x += v;
+#endif
+	}
+
+	/*!
+	\brief Relaxed atomic read-modify-write of a value fitting a machine word, with a compare and swap loop.
+	The function may be called several times when other threads modify the value concurrently.
+	\param f returns the new value from the current one
+	*/
+	template <typename T, typename F>
+	static inline void Update(T& x, const F& f)
+	{
+#if defined(__cpp_lib_atomic_ref)
+		std::atomic_ref<T> ref(x);
+		T old = ref.load(std::memory_order_relaxed);
+		while (!ref.compare_exchange_weak(old, f(old), std::memory_order_relaxed))
+			;
+#else
+#pragma omp critical(AtomicUpdate)
+		x = f(x);
+#endif
+	}
+};
+
+// Half. IEEE 754 half precision float used as a storage type, arithmetic is performed in single precision.
+// Conversions use the F16C instructions when available and round to nearest even.
+class Half
+{
+protected:
+	uint16_t bits = 0;
+
+public:
+	Half() = default;
+
+	/*!
+	\brief Constructor from a single precision float.
+	*/
+	inline Half(float f) : bits(FromFloat(f))
+	{
+	}
+
+	/*!
+	\brief Conversion to a single precision float.
+	*/
+	inline operator float() const
+	{
+		return ToFloat(bits);
+	}
+
+	/*!
+	\brief Convert a float to the bits of the closest half.
+	*/
+	static inline uint16_t FromFloat(float f)
+	{
+#if defined(__F16C__)
+		return uint16_t(_cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT));
+#else
+		uint32_t x;
+		std::memcpy(&x, &f, sizeof(x));
+		const uint32_t sign = (x >> 16) & 0x8000u;
+		const uint32_t abs = x & 0x7FFFFFFFu;
+
+		// NaN and infinity, including overflows after rounding
+		if (abs >= 0x7F800000u)
+			return uint16_t(sign | 0x7C00u | (abs > 0x7F800000u ? 0x200u : 0u));
+		if (abs >= 0x477FF000u)
+			return uint16_t(sign | 0x7C00u);
+
+		// Subnormal halves and zero
+		if (abs < 0x38800000u)
+		{
+			if (abs < 0x33000000u)
+				return uint16_t(sign);
+			const uint32_t e = abs >> 23;
+			const uint32_t m = (abs & 0x7FFFFFu) | 0x800000u;
+			const uint32_t shift = 126u - e;
+			uint32_t h = m >> shift;
+			const uint32_t rest = m & ((1u << shift) - 1u);
+			const uint32_t half = 1u << (shift - 1u);
+			if (rest > half || (rest == half && (h & 1u)))
+				h++;
+			return uint16_t(sign | h);
+		}
+
+		// Normal halves: rebias the exponent, round the mantissa to nearest even
+		uint32_t h = (abs - 0x38000000u) >> 13;
+		const uint32_t rest = abs & 0x1FFFu;
+		if (rest > 0x1000u || (rest == 0x1000u && (h & 1u)))
+			h++;
+		return uint16_t(sign | h);
+#endif
+	}
+
+	/*!
+	\brief Convert the bits of a half to a float.
+	*/
+	static inline float ToFloat(uint16_t h)
+	{
+#if defined(__F16C__)
+		return _cvtsh_ss(h);
+#else
+		const uint32_t sign = uint32_t(h & 0x8000u) << 16;
+		uint32_t e = (h >> 10) & 0x1Fu;
+		uint32_t m = h & 0x3FFu;
+		uint32_t x;
+		if (e == 0x1Fu)
+			x = sign | 0x7F800000u | (m << 13);
+		else if (e != 0)
+			x = sign | ((e + 112u) << 23) | (m << 13);
+		else if (m == 0)
+			x = sign;
+		else
+		{
+			// Subnormal: normalize the mantissa
+			e = 113u;
+			while ((m & 0x400u) == 0)
+			{
+				m <<= 1;
+				e--;
+			}
+			x = sign | (e << 23) | ((m & 0x3FFu) << 13);
+		}
+		float f;
+		std::memcpy(&f, &x, sizeof(f));
+		return f;
+#endif
+	}
+};
+
+// Half4. Four halves packed in 64 bits, such as the fractions of the sediment classes of a cell: the four values
+// are read and written with a single access. The four conversions use one F16C instruction when available.
+class Half4
+{
+protected:
+	uint64_t bits = 0;
+
+public:
+	Half4() = default;
+
+	/*!
+	\brief Constructor from four single precision floats.
+	*/
+	inline explicit Half4(const float* v) : bits(FromFloats(v))
+	{
+	}
+
+	/*!
+	\brief Conversion to four single precision floats.
+	*/
+	inline void ToFloats(float* v) const
+	{
+#if defined(__F16C__)
+		_mm_storeu_ps(v, _mm_cvtph_ps(_mm_cvtsi64_si128((long long)(bits))));
+#else
+		for (int k = 0; k < 4; k++)
+			v[k] = Half::ToFloat(uint16_t(bits >> (16 * k)));
+#endif
+	}
+
+	/*!
+	\brief Convert four floats to the bits of the closest halves.
+	*/
+	static inline uint64_t FromFloats(const float* v)
+	{
+#if defined(__F16C__)
+		return uint64_t(_mm_cvtsi128_si64(_mm_cvtps_ph(_mm_loadu_ps(v), _MM_FROUND_TO_NEAREST_INT)));
+#else
+		uint64_t h = 0;
+		for (int k = 0; k < 4; k++)
+			h |= uint64_t(Half::FromFloat(v[k])) << (16 * k);
+		return h;
+#endif
+	}
+};
+
+// AlignedAllocator. Allocator for std::vector aligning the storage on a given number of bytes,
+// so that vector loads starting at aligned indices are aligned.
+template <typename T, size_t Bytes>
+class AlignedAllocator
+{
+public:
+	typedef T value_type;
+
+	template <typename U>
+	struct rebind
+	{
+		typedef AlignedAllocator<U, Bytes> other;
+	};
+
+	AlignedAllocator() = default;
+
+	template <typename U>
+	inline AlignedAllocator(const AlignedAllocator<U, Bytes>&)
+	{
+	}
+
+	inline T* allocate(size_t n)
+	{
+		return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Bytes)));
+	}
+
+	inline void deallocate(T* p, size_t)
+	{
+		::operator delete(p, std::align_val_t(Bytes));
+	}
+
+	template <typename U>
+	inline bool operator==(const AlignedAllocator<U, Bytes>&) const
+	{
+		return true;
+	}
+
+	template <typename U>
+	inline bool operator!=(const AlignedAllocator<U, Bytes>&) const
+	{
+		return false;
+	}
 };
 
 // AABB 2D class.
@@ -179,19 +466,49 @@ inline Vector2 Box2D::operator[](int i) const
 }
 
 
+// Boundary conditions used to fill the ghost border of padded fields.
+enum class BoundaryMode
+{
+	Periodic,		//!< Toroidal domain: ghost cells copy the opposite edge of the grid.
+	Clamped			//!< Ghost cells replicate the closest edge cell.
+};
+
+// Width of the ghost border of a field, in cells. A distinct type, so that the value a field is filled with
+// can never be read as its border: ScalarField2D(nx, ny, box, 1) fills the field with 1, without ghost cells.
+struct GhostBorder
+{
+	int width = 0;
+};
+
 // ScalarField2D. Represents a 2D field (nx * ny) of scalar values bounded in world space. Can represent a heightfield.
-class ScalarField2D
+// The field can optionally be surrounded by a ghost border, so that stencils can read neighbours with constant
+// offsets and without bound checks. Indices returned by ToIndex1D() are always expressed in the padded storage.
+// The value type is a template parameter, so that masks, flags and counters use the smallest type that fits
+// (uint8_t, uint16_t, Half, int or float); interpolations and statistics are computed in single precision.
+// The storage and the cell (i, 0) of every row are aligned on Alignment bytes, rows being padded accordingly:
+// fields with the same value type, size and border share the same layout and can be indexed with the same indices.
+// The storage index type is a template parameter: 32-bit indices keep the index arithmetic and the gathers cheap
+// for the grids of the simulation, 64-bit indices address grids of more than 2^31 cells.
+template <typename T, typename Index = int>
+class ScalarField2DT
 {
+public:
+	static const int Alignment = 64;				//!< Alignment of the rows, in bytes.
+	static const int Lanes = Alignment / int(sizeof(T));	//!< Number of values per aligned block.
+
 protected:
 	Box2D box;
 	int nx, ny;
-	std::vector<float> values;
+	int border;						//!< Width of the ghost border, in cells.
+	Index stride;					//!< Distance between two consecutive rows in the storage.
+	Index origin;					//!< Storage index of the cell (0, 0).
+	std::vector<T, AlignedAllocator<T, Alignment>> values;
 
 public:
 	/*
 	\brief Default Constructor
 	*/
-	inline ScalarField2D() : nx(0), ny(0)
+	inline ScalarField2DT() : nx(0), ny(0), border(0), stride(0), origin(0)
 	{
 		// Empty
 	}
@@ -201,42 +518,54 @@ public:
 	\param nx size in x axis
 	\param ny size in z axis
 	\param bbox bounding box of the domain in world coordinates
+	\param border ghost border
 	*/
-	inline ScalarField2D(int nx, int ny, const Box2D& bbox) : box(bbox), nx(nx), ny(ny)
+	inline ScalarField2DT(int nx, int ny, const Box2D& bbox, GhostBorder border = GhostBorder()) : box(bbox), nx(nx), ny(ny), border(border.width)
 	{
-		values.resize(size_t(nx * ny));
+		Allocate();
 	}
 
 	/*
-	\brief Constructor
+	\brief Constructor.
 	\param nx size in x axis
 	\param ny size in y axis
 	\param bbox bounding box of the domain
 	\param value default value of the field
+	\param border ghost border
 	*/
-	inline ScalarField2D(int nx, int ny, const Box2D& bbox, float value) : box(bbox), nx(nx), ny(ny)
+	inline ScalarField2DT(int nx, int ny, const Box2D& bbox, T value, GhostBorder border = GhostBorder()) : box(bbox), nx(nx), ny(ny), border(border.width)
 	{
-		values.resize(size_t(nx * ny));
+		Allocate();
 		Fill(value);
 	}
 
-	/*
-	\brief copy constructor
-	\param field Scalarfield2D to copy
-	*/
-	inline ScalarField2D(const ScalarField2D& field) : ScalarField2D(field.nx, field.ny, field.box)
-	{
-		for (unsigned int i = 0; i < values.size(); i++)
-			values[i] = field.values[i];
-	}
+	// Copies keep the layout of the field, moves leave an empty field behind
+	ScalarField2DT(const ScalarField2DT&) = default;
+	ScalarField2DT(ScalarField2DT&&) = default;
+	ScalarField2DT& operator=(const ScalarField2DT&) = default;
+	ScalarField2DT& operator=(ScalarField2DT&&) = default;
+	~ScalarField2DT() = default;
 
-	/*
-	\brief Destructor
+protected:
+	/*!
+	\brief Compute the layout of the storage and allocate it.
 	*/
-	inline ~ScalarField2D()
+	inline void Allocate()
 	{
+		// Rows start with enough padding for the left ghost cells to end on an aligned block
+		const long long lead = (long long)(border + Lanes - 1) / Lanes * Lanes;
+		const long long width = (lead + nx + border + Lanes - 1) / Lanes * Lanes;
+
+		// Sizes are computed in 64 bits, the storage must be addressable with the index type
+		const long long n = width * (long long)(ny + 2 * border);
+		if (nx < 0 || ny < 0 || border < 0 || n > (long long)(std::numeric_limits<Index>::max()))
+			throw std::length_error("ScalarField2D: grid too large for the index type");
+		stride = Index(width);
+		origin = Index(border) * stride + Index(lead);
+		values.resize(size_t(n));
 	}
 
+public:
 	/*
 	\brief Compute the gradient for the vertex (i, j)
 	*/
@@ -246,21 +575,30 @@ public:
 		float cellSizeX = (box.Vertex(1).x - box.Vertex(0).x) / (nx - 1);
 		float cellSizeY = (box.Vertex(1).y - box.Vertex(0).y) / (ny - 1);
 
+		// Padded fields: centered differences everywhere, ghost cells handle the edges
+		if (border > 0)
+		{
+			Index id = ToIndex1D(i, j);
+			ret.x = (float(Atomic::Load(values[id + stride])) - float(Atomic::Load(values[id - stride]))) / (2.0f * cellSizeX);
+			ret.y = (float(Atomic::Load(values[id + 1])) - float(Atomic::Load(values[id - 1]))) / (2.0f * cellSizeY);
+			return ret;
+		}
+
 		// X Gradient
 		if (i == 0)
-			ret.x = (Get(i + 1, j) - Get(i, j)) / cellSizeX;
+			ret.x = (float(Get(i + 1, j)) - float(Get(i, j))) / cellSizeX;
 		else if (i == ny - 1)
-			ret.x = (Get(i, j) - Get(i - 1, j)) / cellSizeX;
+			ret.x = (float(Get(i, j)) - float(Get(i - 1, j))) / cellSizeX;
 		else
-			ret.x = (Get(i + 1, j) - Get(i - 1, j)) / (2.0f * cellSizeX);
+			ret.x = (float(Get(i + 1, j)) - float(Get(i - 1, j))) / (2.0f * cellSizeX);
 
 		// Y Gradient
 		if (j == 0)
-			ret.y = (Get(i, j + 1) - Get(i, j)) / cellSizeY;
+			ret.y = (float(Get(i, j + 1)) - float(Get(i, j))) / cellSizeY;
 		else if (j == nx - 1)
-			ret.y = (Get(i, j) - Get(i, j - 1)) / cellSizeY;
+			ret.y = (float(Get(i, j)) - float(Get(i, j - 1))) / cellSizeY;
 		else
-			ret.y = (Get(i, j + 1) - Get(i, j - 1)) / (2.0f * cellSizeY);
+			ret.y = (float(Get(i, j + 1)) - float(Get(i, j - 1))) / (2.0f * cellSizeY);
 
 		return ret;
 	}
@@ -270,21 +608,23 @@ public:
 	*/
 	inline void NormalizeField()
 	{
+		static_assert(!std::is_integral<T>::value, "Normalization requires a floating point field");
 		float min = Min();
 		float max = Max();
-		for (int i = 0; i < ny * nx; i++)
+		for (size_t i = 0; i < values.size(); i++)
 			values[i] = (values[i] - min) / (max - min);
 	}
 
 	/*
 	\brief Return the normalized version of this field
 	*/
-	inline ScalarField2D Normalized() const
+	inline ScalarField2DT Normalized() const
 	{
-		ScalarField2D ret(*this);
+		static_assert(!std::is_integral<T>::value, "Normalization requires a floating point field");
+		ScalarField2DT ret(*this);
 		float min = Min();
 		float max = Max();
-		for (int i = 0; i < ny * nx; i++)
+		for (size_t i = 0; i < values.size(); i++)
 			ret.values[i] = (ret.values[i] - min) / (max - min);
 		return ret;
 	}
@@ -292,11 +632,12 @@ public:
 	/*!
 	\brief Computes and returns the square root of the ScalarField.
 	*/
-	inline ScalarField2D Sqrt() const
+	inline ScalarField2DT Sqrt() const
 	{
-		ScalarField2D ret(*this);
-		for (int i = 0; i < values.size(); i++)
-			ret.values[i] = sqrt(ret.values[i]);
+		static_assert(!std::is_integral<T>::value, "Square root requires a floating point field");
+		ScalarField2DT ret(*this);
+		for (size_t i = 0; i < values.size(); i++)
+			ret.values[i] = sqrt(float(ret.values[i]));
 		return ret;
 	}
 
@@ -306,7 +647,7 @@ public:
 	inline Vector3 Vertex(int i, int j) const
 	{
 		float x = box.Vertex(0).x + i * (box.Vertex(1).x - box.Vertex(0).x) / (nx - 1);
-		float y = Get(i, j);
+		float y = float(Get(i, j));
 		float z = box.Vertex(0).y + j * (box.Vertex(1).y - box.Vertex(0).y) / (ny - 1);
 		return Vector3(z, y, x);
 	}
@@ -327,7 +668,7 @@ public:
 	inline Vector3 Vertex(const Vector2i& v) const
 	{
 		float x = box.Vertex(0).x + v.x * (box.Vertex(1).x - box.Vertex(0).x) / (nx - 1);
-		float y = Get(v.x, v.y);
+		float y = float(Get(v.x, v.y));
 		float z = box.Vertex(0).y + v.y * (box.Vertex(1).y - box.Vertex(0).y) / (ny - 1);
 		return Vector3(z, y, x);
 	}
@@ -371,26 +712,172 @@ public:
 	/*!
 	\brief Utility.
 	*/
-	inline void ToIndex2D(int index, int& i, int& j) const
+	inline void ToIndex2D(Index index, int& i, int& j) const
 	{
-		i = index / nx;
-		j = index % nx;
+		i = int(index / stride) - border;
+		j = int(index % stride) - int(origin % stride);
 	}
 
 	/*!
 	\brief Utility.
 	*/
-	inline int ToIndex1D(const Vector2i& v) const
+	inline Index ToIndex1D(const Vector2i& v) const
 	{
-		return v.x * nx + v.y;
+		return Index(v.x) * stride + Index(v.y) + origin;
 	}
 
 	/*!
 	\brief Utility.
 	*/
-	inline int ToIndex1D(int i, int j) const
+	inline Index ToIndex1D(int i, int j) const
 	{
-		return i * nx + j;
+		return Index(i) * stride + Index(j) + origin;
+	}
+
+	/*!
+	\brief Compute the storage offset between a cell and its neighbour in direction d.
+	Only valid for |d| <= border, in which case no bound check is needed.
+	*/
+	inline Index Offset(const Vector2i& d) const
+	{
+		return Index(d.x) * stride + Index(d.y);
+	}
+
+	/*!
+	\brief Returns a pointer to the first cell of a row, aligned on Alignment bytes.
+	\param i row, possibly a ghost row
+	*/
+	inline T* Row(int i)
+	{
+		return std::assume_aligned<Alignment>(values.data() + ToIndex1D(i, 0));
+	}
+
+	/*!
+	\brief Returns a pointer to the first cell of a row, aligned on Alignment bytes.
+	\param i row, possibly a ghost row
+	*/
+	inline const T* Row(int i) const
+	{
+		return std::assume_aligned<Alignment>(values.data() + ToIndex1D(i, 0));
+	}
+
+	/*!
+	\brief Returns the width of the ghost border.
+	*/
+	inline int Border() const
+	{
+		return border;
+	}
+
+	/*!
+	\brief Fill the ghost border from the interior of the field.
+	Must be called after the interior has been modified for neighbour reads to be up to date.
+	\param mode boundary condition.
+	*/
+	inline void RefreshGhosts(BoundaryMode mode)
+	{
+		if (border == 0)
+			return;
+
+		// Left and right columns of interior rows, then full top and bottom rows (including corners)
+		for (int i = 0; i < ny; i++)
+		{
+			for (int k = 1; k <= border; k++)
+			{
+				values[ToIndex1D(i, -k)] = values[ToIndex1D(i, GhostSource(-k, nx, mode))];
+				values[ToIndex1D(i, nx - 1 + k)] = values[ToIndex1D(i, GhostSource(nx - 1 + k, nx, mode))];
+			}
+		}
+		for (int k = 1; k <= border; k++)
+		{
+			std::copy_n(values.begin() + ToIndex1D(GhostSource(-k, ny, mode), -border), nx + 2 * border, values.begin() + ToIndex1D(-k, -border));
+			std::copy_n(values.begin() + ToIndex1D(GhostSource(ny - 1 + k, ny, mode), -border), nx + 2 * border, values.begin() + ToIndex1D(ny - 1 + k, -border));
+		}
+	}
+
+	/*!
+	\brief Fill the ghost border with a constant value, for instance to model a wall.
+	*/
+	inline void FillGhosts(T v)
+	{
+		for (int i = -border; i < ny + border; i++)
+		{
+			for (int j = -border; j < nx + border; j++)
+			{
+				if (i < 0 || i >= ny || j < 0 || j >= nx)
+					values[ToIndex1D(i, j)] = v;
+			}
+		}
+	}
+
+	/*!
+	\brief Copy the value of an interior cell to all the ghost cells that mirror it.
+	Should be called after modifying a single cell, so that neighbour reads across the border
+	stay consistent between two calls to RefreshGhosts().
+	Only the ghost cells are written, never the interior cell itself, so that a concurrent FetchAdd() on the
+	cell cannot be overwritten. Concurrent refreshes of a cell may leave a ghost image one update behind,
+	until the next call to RefreshGhosts().
+	\param i, j interior cell
+	\param mode boundary condition.
+	*/
+	inline void RefreshGhost(int i, int j, BoundaryMode mode)
+	{
+		// Only cells close to the edges are mirrored
+		if (i >= border && i < ny - border && j >= border && j < nx - border)
+			return;
+
+		int rows[9], columns[9];
+		const int nr = GhostImages(i, ny, mode, rows);
+		const int nc = GhostImages(j, nx, mode, columns);
+		const T v = Atomic::Load(values[ToIndex1D(i, j)]);
+		for (int a = 0; a < nr; a++)
+		{
+			// The first image is the cell itself
+			for (int b = (a == 0 ? 1 : 0); b < nc; b++)
+				Atomic::Store(values[ToIndex1D(rows[a], columns[b])], v);
+		}
+	}
+
+	/*!
+	\brief Compute the coordinates, along one axis, of an interior cell and of all its ghost images.
+	Returns the number of coordinates, the first one being the cell itself. Borders are at most 4 cells wide.
+	\param k interior coordinate
+	\param n size of the axis
+	\param mode boundary condition
+	\param images returned coordinates
+	*/
+	inline int GhostImages(int k, int n, BoundaryMode mode, int* images) const
+	{
+		int c = 0;
+		images[c++] = k;
+		if (mode == BoundaryMode::Periodic)
+		{
+			if (k < border)
+				images[c++] = k + n;
+			if (k >= n - border)
+				images[c++] = k - n;
+		}
+		else
+		{
+			for (int g = 1; g <= border && k == 0; g++)
+				images[c++] = -g;
+			for (int g = 1; g <= border && k == n - 1; g++)
+				images[c++] = n - 1 + g;
+		}
+		return c;
+	}
+
+	/*!
+	\brief Compute the interior coordinate that a ghost coordinate refers to.
+	\param k coordinate, possibly outside of [0, n - 1]
+	\param n size of the axis
+	\param mode boundary condition
+	*/
+	static inline int GhostSource(int k, int n, BoundaryMode mode)
+	{
+		if (mode == BoundaryMode::Periodic)
+			return ((k % n) + n) % n;
+		return Math::Clamp(k, 0, n - 1);
 	}
 
 	/*!
@@ -416,33 +903,33 @@ public:
 	/*!
 	\brief Returns the value of the field at a given coordinate.
 	*/
-	inline float Get(int row, int column) const
+	inline T Get(int row, int column) const
 	{
-		int index = ToIndex1D(row, column);
-		return values[index];
+		Index index = ToIndex1D(row, column);
+		return Atomic::Load(values[index]);
 	}
 
 	/*!
 	\brief Returns the value of the field at a given coordinate.
 	*/
-	inline float Get(int index) const
+	inline T Get(Index index) const
 	{
-		return values[index];
+		return Atomic::Load(values[index]);
 	}
 
 	/*!
 	\brief Returns the value of the field at a given coordinate.
 	*/
-	inline float Get(const Vector2i& v) const
+	inline T Get(const Vector2i& v) const
 	{
-		int index = ToIndex1D(v);
-		return values[index];
+		Index index = ToIndex1D(v);
+		return Atomic::Load(values[index]);
 	}
 
 	/*!
 	\brief Todo
 	*/
-	void Add(int i, int j, float v)
+	void Add(int i, int j, T v)
 	{
 		values[ToIndex1D(i, j)] += v;
 	}
@@ -450,7 +937,7 @@ public:
 	/*!
 	\brief Todo
 	*/
-	void Remove(int i, int j, float v)
+	void Remove(int i, int j, T v)
 	{
 		values[ToIndex1D(i, j)] -= v;
 	}
@@ -458,24 +945,28 @@ public:
 	/*!
 	\brief Todo
 	*/
-	void Add(const ScalarField2D& field)
+	void Add(const ScalarField2DT& field)
 	{
-		for (int i = 0; i < values.size(); i++)
+		for (size_t i = 0; i < values.size(); i++)
 			values[i] += field.values[i];
 	}
 
 	/*!
 	\brief Todo
 	*/
-	void Remove(const ScalarField2D& field)
+	void Remove(const ScalarField2DT& field)
 	{
-		for (int i = 0; i < values.size(); i++)
+		for (size_t i = 0; i < values.size(); i++)
 			values[i] -= field.values[i];
 	}
 
+	//! Value returned by the bilinear samplers at points outside of the grid.
+	static constexpr float OutsideValue = -1.0f;
+
 	/*!
 	\brief Compute the bilinear interpolation at a given world point.
 	\param p world point.
+	\returns the interpolated value, or OutsideValue outside of the grid.
 	*/
 	inline float GetValueBilinear(const Vector2& p) const
 	{
@@ -492,7 +983,7 @@ public:
 		int j = int(u * (nx - 1));
 
 		if (!Inside(i, j) || !Inside(i + 1, j + 1))
-			return -1.0;
+			return OutsideValue;
 
 		float anchorU = j * texelX;
 		float anchorV = i * texelY;
@@ -500,10 +991,10 @@ public:
 		float localU = (u - anchorU) / texelX;
 		float localV = (v - anchorV) / texelY;
 
-		float v1 = Get(i, j);
-		float v2 = Get(i + 1, j);
-		float v3 = Get(i + 1, j + 1);
-		float v4 = Get(i, j + 1);
+		float v1 = float(Get(i, j));
+		float v2 = float(Get(i + 1, j));
+		float v3 = float(Get(i + 1, j + 1));
+		float v4 = float(Get(i, j + 1));
 
 		return (1 - localU) * (1 - localV) * v1
 			+ (1 - localU) * localV * v2
@@ -511,10 +1002,119 @@ public:
 			+ localU * localV * v3;
 	}
 
+	/*!
+	\brief Compute the sum of the bilinear interpolations of two fields at a given world point, such as the
+	elevation of a terrain made of two layers. The cell and the weights are computed once for both fields,
+	which must share the same grid and border. Returns the sum of two calls to GetValueBilinear(), up to rounding,
+	inside of the grid, and OutsideValue outside. The values are read with relaxed atomic loads, so the fields
+	may be modified concurrently.
+	\param a, b fields
+	\param p world point.
+	*/
+	static inline float GetValueBilinearSum(const ScalarField2DT& a, const ScalarField2DT& b, const Vector2& p)
+	{
+		Vector2 q = p - a.box.Vertex(0);
+		Vector2 d = a.box.Vertex(1) - a.box.Vertex(0);
+
+		float texelX = 1.0f / float(a.nx - 1);
+		float texelY = 1.0f / float(a.ny - 1);
+
+		float u = q[0] / d[0];
+		float v = q[1] / d[1];
+
+		int i = int(v * (a.ny - 1));
+		int j = int(u * (a.nx - 1));
+
+		if (!a.Inside(i, j) || !a.Inside(i + 1, j + 1))
+			return OutsideValue;
+
+		float anchorU = j * texelX;
+		float anchorV = i * texelY;
+
+		float localU = (u - anchorU) / texelX;
+		float localV = (v - anchorV) / texelY;
+
+		const float w1 = (1 - localU) * (1 - localV);
+		const float w2 = (1 - localU) * localV;
+		const float w4 = localU * (1 - localV);
+		const float w3 = localU * localV;
+		const Index id = a.ToIndex1D(i, j);
+		const Index s = a.stride;
+		const float va = w1 * float(Atomic::Load(a.values[id])) + w2 * float(Atomic::Load(a.values[id + s]))
+			+ w4 * float(Atomic::Load(a.values[id + 1])) + w3 * float(Atomic::Load(a.values[id + s + 1]));
+		const float vb = w1 * float(Atomic::Load(b.values[id])) + w2 * float(Atomic::Load(b.values[id + s]))
+			+ w4 * float(Atomic::Load(b.values[id + 1])) + w3 * float(Atomic::Load(b.values[id + s + 1]));
+		return va + vb;
+	}
+
+	/*!
+	\brief Batched version of GetValueBilinearSum() for 8 points, such as the samples of a march along the wind.
+	The AVX2 path reads the fields with plain gathers, and is only valid on frozen fields that no other thread
+	modifies during the call, such as a sediment layer and a bedrock sampled before or between transport steps.
+	Fields that are concurrently modified must be sampled with GetValueBilinearSum().
+	\param a, b fields
+	\param x, y coordinates of the 8 world points
+	\param values returned sums
+	*/
+	static inline void GetValueBilinearSum8(const ScalarField2DT& a, const ScalarField2DT& b, const float* x, const float* y, float* values)
+	{
+#if defined(__AVX2__)
+		// Gathers take 32-bit indices and read floats
+		if constexpr (sizeof(Index) == 4 && std::is_same<T, float>::value)
+		{
+			const Vector2 o = a.box.Vertex(0);
+			const Vector2 d = a.box.Vertex(1) - a.box.Vertex(0);
+			const float texelX = 1.0f / float(a.nx - 1);
+			const float texelY = 1.0f / float(a.ny - 1);
+			const __m256 one = _mm256_set1_ps(1.0f);
+
+			const __m256 u = _mm256_div_ps(_mm256_sub_ps(_mm256_loadu_ps(x), _mm256_set1_ps(o[0])), _mm256_set1_ps(d[0]));
+			const __m256 v = _mm256_div_ps(_mm256_sub_ps(_mm256_loadu_ps(y), _mm256_set1_ps(o[1])), _mm256_set1_ps(d[1]));
+			const __m256i i = _mm256_cvttps_epi32(_mm256_mul_ps(v, _mm256_set1_ps(float(a.ny - 1))));
+			const __m256i j = _mm256_cvttps_epi32(_mm256_mul_ps(u, _mm256_set1_ps(float(a.nx - 1))));
+
+			// Same test as Inside(i, j) && Inside(i + 1, j + 1)
+			const __m256i minusOne = _mm256_set1_epi32(-1);
+			const __m256i inside = _mm256_and_si256(
+				_mm256_and_si256(_mm256_cmpgt_epi32(i, minusOne), _mm256_cmpgt_epi32(j, minusOne)),
+				_mm256_and_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(a.nx - 1), i), _mm256_cmpgt_epi32(_mm256_set1_epi32(a.ny - 1), j)));
+
+			const __m256 localU = _mm256_div_ps(_mm256_sub_ps(u, _mm256_mul_ps(_mm256_cvtepi32_ps(j), _mm256_set1_ps(texelX))), _mm256_set1_ps(texelX));
+			const __m256 localV = _mm256_div_ps(_mm256_sub_ps(v, _mm256_mul_ps(_mm256_cvtepi32_ps(i), _mm256_set1_ps(texelY))), _mm256_set1_ps(texelY));
+			const __m256 w1 = _mm256_mul_ps(_mm256_sub_ps(one, localU), _mm256_sub_ps(one, localV));
+			const __m256 w2 = _mm256_mul_ps(_mm256_sub_ps(one, localU), localV);
+			const __m256 w4 = _mm256_mul_ps(localU, _mm256_sub_ps(one, localV));
+			const __m256 w3 = _mm256_mul_ps(localU, localV);
+
+			// Points outside of the grid read the first cell, their result is replaced afterwards
+			const __m256i id = _mm256_and_si256(inside, _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(i, _mm256_set1_epi32(a.stride)), j), _mm256_set1_epi32(a.origin)));
+			const __m256i s = _mm256_set1_epi32(a.stride);
+			const __m256i id2 = _mm256_add_epi32(id, s);
+			const __m256i id4 = _mm256_add_epi32(id, _mm256_set1_epi32(1));
+			const __m256i id3 = _mm256_add_epi32(id2, _mm256_set1_epi32(1));
+			const float* fields[2] = { a.values.data(), b.values.data() };
+			__m256 sum[2];
+			for (int f = 0; f < 2; f++)
+			{
+				sum[f] = _mm256_add_ps(
+					_mm256_add_ps(
+						_mm256_add_ps(_mm256_mul_ps(w1, _mm256_i32gather_ps(fields[f], id, 4)), _mm256_mul_ps(w2, _mm256_i32gather_ps(fields[f], id2, 4))),
+						_mm256_mul_ps(w4, _mm256_i32gather_ps(fields[f], id4, 4))),
+					_mm256_mul_ps(w3, _mm256_i32gather_ps(fields[f], id3, 4)));
+			}
+			const __m256 ret = _mm256_blendv_ps(_mm256_set1_ps(OutsideValue), _mm256_add_ps(sum[0], sum[1]), _mm256_castsi256_ps(inside));
+			_mm256_storeu_ps(values, ret);
+			return;
+		}
+#endif
+		for (int k = 0; k < 8; k++)
+			values[k] = GetValueBilinearSum(a, b, Vector2(x[k], y[k]));
+	}
+
 	/*!
 	\brief Fill all the field with a given value.
 	*/
-	inline void Fill(float v)
+	inline void Fill(T v)
 	{
 		std::fill(values.begin(), values.end(), v);
 	}
@@ -523,33 +1123,94 @@ public:
 	\brief Return the data in the field.
 	\param c Index.
 	*/
-	inline float& operator[](int c)
+	inline T& operator[](Index c)
 	{
 		return values[c];
 	}
 
+	/*!
+	\brief Returns a pointer to the storage, indexed with ToIndex1D().
+	*/
+	inline const T* Data() const
+	{
+		return values.data();
+	}
+
+	/*!
+	\brief Returns a pointer to the storage, indexed with ToIndex1D().
+	*/
+	inline T* Data()
+	{
+		return values.data();
+	}
+
+	/*!
+	\brief Copy a slice of the storage of a field with the same size and border, ghost cells included.
+	The slices of a copy can be copied concurrently.
+	\param field copied field
+	\param slice, slices index of the slice and number of slices
+	*/
+	inline void CopySlice(const ScalarField2DT& field, int slice, int slices)
+	{
+		const size_t begin = values.size() * slice / slices;
+		const size_t end = values.size() * (slice + 1) / slices;
+		std::copy(field.values.begin() + begin, field.values.begin() + end, values.begin() + begin);
+	}
+
+	/*!
+	\brief Exchange the content of two fields, without copying the values.
+	*/
+	inline void Swap(ScalarField2DT& field)
+	{
+		std::swap(box, field.box);
+		std::swap(nx, field.nx);
+		std::swap(ny, field.ny);
+		std::swap(border, field.border);
+		std::swap(stride, field.stride);
+		std::swap(origin, field.origin);
+		values.swap(field.values);
+	}
+
 	/*!
 	\brief Set a given value at a given coordinate.
 	*/
-	inline void Set(int row, int column, float v)
+	inline void Set(int row, int column, T v)
 	{
-		values[ToIndex1D(row, column)] = v;
+		Atomic::Store(values[ToIndex1D(row, column)], v);
 	}
 
 	/*!
 	\brief Set a given value at a given coordinate.
 	*/
-	inline void Set(int index, float v)
+	inline void Set(Index index, T v)
 	{
-		values[index] = v;
+		Atomic::Store(values[index], v);
+	}
+
+	/*!
+	\brief Add a value at a given coordinate, atomically. Can be called concurrently from several threads.
+	*/
+	inline void FetchAdd(Index index, T v)
+	{
+		Atomic::Add(values[index], v);
+	}
+
+	/*!
+	\brief Replace the value at a given coordinate by a function of itself, atomically. Can be called concurrently from several threads.
+	\param f returns the new value from the current one, may be called several times
+	*/
+	template <typename F>
+	inline void FetchUpdate(Index index, const F& f)
+	{
+		Atomic::Update(values[index], f);
 	}
 
 	/*!
 	\brief Todo
 	*/
-	inline void ThresholdInferior(float t, float v)
+	inline void ThresholdInferior(T t, T v)
 	{
-		for (int i = 0; i < values.size(); i++)
+		for (size_t i = 0; i < values.size(); i++)
 		{
 			if (values[i] <= t)
 				values[i] = v;
@@ -559,15 +1220,18 @@ public:
 	/*!
 	\brief Compute the maximum of the field.
 	*/
-	inline float Max() const
+	inline T Max() const
 	{
 		if (values.size() == 0)
-			return 0.0f;
-		float max = values[0];
-		for (int i = 1; i < values.size(); i++)
+			return T(0);
+		T max = values[origin];
+		for (int i = 0; i < ny; i++)
 		{
-			if (values[i] > max)
-				max = values[i];
+			for (int j = 0; j < nx; j++)
+			{
+				if (Get(i, j) > max)
+					max = Get(i, j);
+			}
 		}
 		return max;
 	}
@@ -575,15 +1239,18 @@ public:
 	/*!
 	\brief Compute the minimum of the field.
 	*/
-	inline float Min() const
+	inline T Min() const
 	{
 		if (values.size() == 0)
-			return 0.0f;
-		float min = values[0];
-		for (int i = 1; i < values.size(); i++)
+			return T(0);
+		T min = values[origin];
+		for (int i = 0; i < ny; i++)
 		{
-			if (values[i] < min)
-				min = values[i];
+			for (int j = 0; j < nx; j++)
+			{
+				if (Get(i, j) < min)
+					min = Get(i, j);
+			}
 		}
 		return min;
 	}
@@ -594,9 +1261,12 @@ public:
 	inline float Average() const
 	{
 		float sum = 0.0f;
-		for (int i = 0; i < values.size(); i++)
-			sum += values[i];
-		return sum / values.size();
+		for (int i = 0; i < ny; i++)
+		{
+			for (int j = 0; j < nx; j++)
+				sum += float(Get(i, j));
+		}
+		return sum / (float(nx) * float(ny));
 	}
 
 	/*!
@@ -642,8 +1312,155 @@ public:
 	/*!
 	\brief Compute the memory used by the field.
 	*/
-	inline int Memory() const
+	inline size_t Memory() const
 	{
-		return sizeof(ScalarField2D) + sizeof(float) * int(values.size());
+		return sizeof(ScalarField2DT) + sizeof(T) * values.size();
 	}
 };
+
+typedef ScalarField2DT<float> ScalarField2D;
+typedef ScalarField2DT<float, long long> ScalarField2D64;
+typedef ScalarField2DT<uint8_t> ByteField2D;
+typedef ScalarField2DT<uint16_t> ShortField2D;
+typedef ScalarField2DT<Half> HalfField2D;
+typedef ScalarField2DT<Half4> Half4Field2D;
+typedef ScalarField2DT<int> IntField2D;
+
+// TiledField2D. Copy-on-write snapshot of the interior of a field, split into square tiles shared through reference
+// counting. Copies only duplicate the tile pointers. A snapshot taken against a previous one shares the tiles whose
+// values did not change, so that the branches of a simulation only pay memory for the regions they modify.
+template <typename T, typename Index = int>
+class TiledField2DT
+{
+public:
+	static const int TileSize = 64;					//!< Size of the tiles, in cells.
+	typedef std::vector<T> Tile;
+
+protected:
+	Box2D box;
+	int nx = 0, ny = 0;
+	int border = 0;					//!< Width of the ghost border of the captured field.
+	int tilesX = 0, tilesY = 0;
+	std::vector<std::shared_ptr<const Tile>> tiles;
+
+public:
+	/*!
+	\brief Default constructor, empty snapshot.
+	*/
+	TiledField2DT() = default;
+
+	/*!
+	\brief Capture a field.
+	\param field captured field
+	\param base previous snapshot of the same grid whose identical tiles are shared, or nullptr
+	*/
+	inline explicit TiledField2DT(const ScalarField2DT<T, Index>& field, const TiledField2DT* base = nullptr)
+		: box(field.GetBox()), nx(field.SizeX()), ny(field.SizeY()), border(field.Border())
+	{
+		tilesX = (nx + TileSize - 1) / TileSize;
+		tilesY = (ny + TileSize - 1) / TileSize;
+		tiles.resize(size_t(tilesX) * tilesY);
+		const bool shared = base != nullptr && base->nx == nx && base->ny == ny;
+		for (int ti = 0; ti < tilesY; ti++)
+		{
+			for (int tj = 0; tj < tilesX; tj++)
+			{
+				const int i0 = ti * TileSize, j0 = tj * TileSize;
+				const int rows = Math::Min(TileSize, ny - i0);
+				const int columns = Math::Min(TileSize, nx - j0);
+				const int t = ti * tilesX + tj;
+
+				// Bitwise comparison with the tile of the base
+				bool same = shared;
+				for (int r = 0; r < rows && same; r++)
+					same = std::memcmp(field.Data() + field.ToIndex1D(i0 + r, j0), base->tiles[t]->data() + size_t(r) * columns, sizeof(T) * columns) == 0;
+				if (same)
+				{
+					tiles[t] = base->tiles[t];
+					continue;
+				}
+
+				std::shared_ptr<Tile> tile = std::make_shared<Tile>(size_t(rows) * columns);
+				for (int r = 0; r < rows; r++)
+					std::copy_n(field.Data() + field.ToIndex1D(i0 + r, j0), columns, tile->data() + size_t(r) * columns);
+				tiles[t] = tile;
+			}
+		}
+	}
+
+	/*!
+	\brief Copy the snapshot into a field, reallocated if its size or border differ. Ghost cells are not restored.
+	*/
+	inline void Restore(ScalarField2DT<T, Index>& field) const
+	{
+		if (field.SizeX() != nx || field.SizeY() != ny || field.Border() != border)
+			field = ScalarField2DT<T, Index>(nx, ny, box, GhostBorder{ border });
+		for (int ti = 0; ti < tilesY; ti++)
+		{
+			for (int tj = 0; tj < tilesX; tj++)
+			{
+				const int i0 = ti * TileSize, j0 = tj * TileSize;
+				const int rows = Math::Min(TileSize, ny - i0);
+				const int columns = Math::Min(TileSize, nx - j0);
+				const Tile& tile = *tiles[ti * tilesX + tj];
+				for (int r = 0; r < rows; r++)
+					std::copy_n(tile.data() + size_t(r) * columns, columns, field.Data() + field.ToIndex1D(i0 + r, j0));
+			}
+		}
+	}
+
+	/*!
+	\brief Returns the size of x-axis of the captured field.
+	*/
+	inline int SizeX() const
+	{
+		return nx;
+	}
+
+	/*!
+	\brief Returns the size of y-axis of the captured field.
+	*/
+	inline int SizeY() const
+	{
+		return ny;
+	}
+
+	/*!
+	\brief Returns the number of tiles.
+	*/
+	inline int Tiles() const
+	{
+		return int(tiles.size());
+	}
+
+	/*!
+	\brief Returns the number of tiles shared with another snapshot.
+	*/
+	inline int SharedTiles(const TiledField2DT& snapshot) const
+	{
+		if (snapshot.tiles.size() != tiles.size())
+			return 0;
+		int n = 0;
+		for (size_t t = 0; t < tiles.size(); t++)
+			n += tiles[t] == snapshot.tiles[t] ? 1 : 0;
+		return n;
+	}
+
+	/*!
+	\brief Compute the memory used by the tiles, excluding the ones shared with a given snapshot.
+	\param base snapshot, or nullptr to count all the tiles
+	*/
+	inline size_t Memory(const TiledField2DT* base = nullptr) const
+	{
+		size_t memory = sizeof(TiledField2DT) + sizeof(std::shared_ptr<const Tile>) * tiles.size();
+		for (size_t t = 0; t < tiles.size(); t++)
+		{
+			if (base == nullptr || base->tiles.size() != tiles.size() || tiles[t] != base->tiles[t])
+				memory += sizeof(T) * tiles[t]->size();
+		}
+		return memory;
+	}
+};
+
+typedef TiledField2DT<float> TiledField2D;
+typedef TiledField2DT<Half4> TiledHalf4Field2D;
@@ -0,0 +1,25 @@
+#pragma once
+
+class DuneSediment;
+
+// Benchmarks of the simulation, run with the "benchmark" argument. Each benchmark starts from copies of the given terrain and prints its measures.
+void BenchmarkFlowDirections(const DuneSediment& terrain);
+void BenchmarkFieldAccess(const DuneSediment& terrain);
+void BenchmarkHeightSampler(const DuneSediment& terrain);
+void BenchmarkAvalanches(const DuneSediment& terrain, int steps);
+void BenchmarkExecution(const DuneSediment& terrain, int steps);
+void BenchmarkStepMode(const DuneSediment& terrain, int steps);
+void BenchmarkAuxiliaryMode(const DuneSediment& terrain, int steps);
+void BenchmarkWindAlignment(const DuneSediment& terrain, int steps);
+void BenchmarkBedrockStabilization(const DuneSediment& terrain, int steps);
+void BenchmarkGrainBudget(const DuneSediment& terrain, int steps);
+void BenchmarkLiftOrder(const DuneSediment& terrain, int steps);
+void BenchmarkLiftSampling(const DuneSediment& terrain, int steps, float tolerance);
+void BenchmarkSnapshots(const DuneSediment& terrain, int steps);
+void BenchmarkEditHistory(const DuneSediment& terrain, int edits);
+void BenchmarkSleepingTiles(const DuneSediment& terrain, int steps);
+void BenchmarkTransportEngine(const DuneSediment& terrain, int steps);
+void BenchmarkTurbulence(const DuneSediment& terrain, int steps);
+void BenchmarkWindSolver(const DuneSediment& terrain, int steps);
+void BenchmarkRepose(const DuneSediment& terrain, int steps);
+void BenchmarkSedimentClasses(const DuneSediment& terrain, int steps);
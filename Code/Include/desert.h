@@ -1,6 +1,14 @@
 #pragma once
 
 #include "basics.h"
+#include "scheduler.h"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
 
 const float M_PI = 3.14159265358979323846f;
 // Degrees to radians
@@ -8,28 +16,367 @@ static float ToRadians(float degrees)
 {
 	return degrees * M_PI / 180.0f;
 }
+
+// Tangents of the angles stored in the per-cell repose fields, quantized by half degrees.
+struct ReposeTangents
+{
+	float tangent[256];
+
+	ReposeTangents()
+	{
+		for (int k = 0; k < 256; k++)
+			tangent[k] = tanf(ToRadians(Math::Min(0.5f * float(k), 89.5f)));
+	}
+
+	// Code of an angle, in degrees
+	static uint8_t Quantize(float degrees)
+	{
+		return uint8_t(Math::Clamp(int(degrees * 2.0f + 0.5f), 0, 179));
+	}
+};
+
+// Features of the simulation, combined in a bit mask.
+enum SimulationFeature
+{
+	VegetationFeature = 1,			//!< Vegetation retains sediments and protects from abrasion.
+	AbrasionFeature = 2,			//!< Saltating grains abrade the bedrock.
+	ReptationFeature = 4,			//!< Grains creep to their neighbours at each bounce.
+	ShadowFeature = 8,				//!< Wind shadowing of the lee sides.
+	CascadeFeature = 16,			//!< Avalanches are resolved by a cascade from each moved grain.
+	SedimentClassFeature = 32,		//!< Grains belong to sediment classes, see SedimentClass.
+	TwoPhaseFeature = 64,			//!< Grains read the terrain of the beginning of the step, see StepMode::TwoPhase.
+	OnTheFlyFeature = 128,			//!< Grains compute the wind and shadows from the current terrain, see AuxiliaryMode::OnTheFly.
+	FeatureCombinations = 256
+};
+
+/*!
+\brief Compile-time set of simulation features. The transport kernel is instantiated
+for every combination, so that disabled features cost nothing in the inner loop.
+*/
+template<int Features>
+struct SimulationPolicy
+{
+	static const bool Vegetation = (Features & VegetationFeature) != 0;
+	static const bool Abrasion = (Features & AbrasionFeature) != 0;
+	static const bool Reptation = (Features & ReptationFeature) != 0;
+	static const bool Shadow = (Features & ShadowFeature) != 0;
+	static const bool Cascades = (Features & CascadeFeature) != 0;
+	static const bool Classes = (Features & SedimentClassFeature) != 0;
+	static const bool TwoPhase = (Features & TwoPhaseFeature) != 0;
+	static const bool OnTheFly = (Features & OnTheFlyFeature) != 0;
+};
+
+// Parallel execution of the grain transport.
+enum class ExecutionMode
+{
+	OpenMP,			//!< Static partition of the grains between the OpenMP threads.
+	WorkStealing	//!< Tasks executed by a work stealing pool, long cascades are split into stealable tasks.
+};
+
+// Resolution of sand avalanches.
+enum class AvalancheMode
+{
+	PerGrain,		//!< Serial cascades from the start and destination cells of each grain.
+	Relaxation		//!< Data-parallel relaxation of the whole grid at the end of each step.
+};
+
+// Organization of the reads and writes of a simulation step.
+enum class StepMode
+{
+	InPlace,		//!< Grains read and write the same sediment layer.
+	TwoPhase		//!< Grains read the terrain of the beginning of the step and accumulate their changes into zeroed
+					//!< buffers, added to the terrain at the end of the step. Avalanches are resolved by relaxation.
+};
+
+// Computation of the wind and wind shadowing used by the grain transport.
+enum class AuxiliaryMode
+{
+	OnTheFly,		//!< Computed by each grain from the current terrain.
+	Precomputed,	//!< Computed for every cell at the beginning of the step.
+	Pipelined		//!< Computed for step n + 1 by a few threads taken from the transport of step n,
+					//!< from a snapshot of the terrain taken at the beginning of step n.
+};
+
+// Wind and wind shadowing of every cell, see AuxiliaryMode.
+struct AuxiliaryFields
+{
+	ScalarField2D windX;			//!< Wind, x component.
+	ScalarField2D windY;			//!< Wind, y component.
+	ScalarField2D shadow;			//!< Probability of wind shadowing.
+};
+
+// Number of grains lifted by a simulation step.
+enum class GrainBudgetMode
+{
+	Grid,			//!< One grain per cell of the grid, lifted anywhere on the grid.
+	Absolute,		//!< A fixed number of grains, lifted from the cells covered with sediments.
+	PerActiveCell,	//!< A number of grains per cell covered with sediments.
+	MobileMass		//!< A number of grains per amount of sand a grain can lift, summed over the grid.
+};
+
+// Distribution of the lift sites of the grains of a step, among the cells of the grid or the active cells.
+enum class LiftSampling
+{
+	Random,			//!< Independent uniform draws: some cells are drawn several times per step, others never.
+	Stratified,		//!< One jittered draw per stratum of consecutive cells.
+	LowDiscrepancy,	//!< Rank-1 lattice with a golden ratio stride and a random offset per step, every cell drawn once per cycle.
+	Permutation		//!< Affine permutation of the cells with a random stride and offset per step.
+};
+
+// Order in which the grains of a step are processed.
+enum class LiftOrder
+{
+	Unsorted,		//!< Each grain draws its lift site when it is processed.
+	Tiled			//!< The lift sites of the step are drawn up front and binned by tile, each tile is processed by one thread.
+};
+
+// Transport of the sand by the wind.
+enum class TransportEngine
+{
+	Grains,			//!< Monte Carlo transport of individual grains.
+	Flux			//!< Deterministic transport of the expected sand flux of every cell, see SimulationStepFlux().
+};
+
+// Grain size class of the sand, see DuneSediment::SetSedimentClasses(). Fine grains are lifted in larger amounts
+// and hop further than coarse grains, which are left behind at the surface: the lag armors the sand below.
+struct SedimentClass
+{
+	float fraction = 1.0f;			//!< Initial share of the class in the sand of every cell.
+	float mass = 1.0f;				//!< Amount of sand moved by a grain of the class, relative to the amount moved without classes.
+	float hop = 1.0f;				//!< Saltation hop length of the class, relative to the wind.
+	float repose = 33.0f;			//!< Repose angle of the class, in degrees.
+};
+
+// Maintenance operations run periodically at the end of the simulation steps, see SetTaskPeriod().
+enum MaintenanceTask
+{
+	BedrockStabilizationTask = 0,	//!< Stabilization of the bedrock layer, only performed when abrasion is turned on.
+	StatisticsTask = 1,				//!< Sediment budget and elevation range of the terrain, see Statistics().
+	GhostRefreshTask = 2,			//!< Full rebuild of the ghost cells of the padded fields.
+	WindSolverTask = 3,				//!< Solution of the coarse wind field, only performed when the wind solver is turned on.
+	MaintenanceTasks = 4
+};
+
+// Summary of the terrain, gathered by the statistics maintenance task.
+struct TerrainStatistics
+{
+	int step = -1;					//!< Simulation step at which the statistics were completed, -1 if never gathered.
+	double sediments = 0.0;			//!< Sum of the sediment layer over the grid, in meter.
+	float minHeight = 0.0f;			//!< Lowest terrain elevation, in meter.
+	float maxHeight = 0.0f;			//!< Highest terrain elevation, in meter.
+	float maxSediment = 0.0f;		//!< Thickest sediment layer, in meter.
+};
+
+// State of a simulation captured by DuneSediment::Snapshot(). The terrain layers and the sediment mix are stored as
+// copy-on-write tiles: copying a snapshot is proportional to the number of tiles, and snapshots of diverging branches
+// share the tiles they did not modify. Layers are expressed in the simulation frame, restored together with the frame.
+struct DuneSnapshot
+{
+	int step = 0;					//!< Simulation step at which the snapshot was taken.
+	int windRotation = 0;			//!< Simulation frame of the layers, see DuneSediment::SetWindAlignment().
+	Vector2 wind;					//!< Base wind, in the simulation frame.
+	TerrainStatistics statistics;
+	TerrainStatistics pendingStatistics;
+	TiledField2D bedrock;
+	TiledField2D sediments;
+	TiledField2D vegetation;
+	std::shared_ptr<const std::vector<unsigned char>> abradedCells;	//!< Cells abraded since the last bedrock stabilization.
+	TiledHalf4Field2D sedimentMix;	//!< Fractions of the sediment classes, no tiles without classes.
+
+	size_t Memory(const DuneSnapshot* base = nullptr) const;
+};
+
+// Change of the terrain layers made by one edit, see DuneSediment::Edit(). For every touched tile and layer,
+// the bitwise XOR of the values before and after the edit is stored with its runs of unchanged cells
+// run-length encoded: the same delta undoes and redoes the edit, as long as no step modified the terrain since.
+struct EditRecord
+{
+	std::string name;				//!< Name of the edit, for reports.
+	int step = 0;					//!< Simulation step at which the edit was made.
+	int layers = 3;					//!< Number of encoded layers: the sediment mix follows the three terrain layers with sediment classes.
+	std::vector<int> tiles;			//!< Touched tiles of EditTileSize² cells, in the simulation frame.
+	std::vector<uint32_t> deltas;	//!< Encoded deltas of the bedrock, sediment and vegetation layers and of the mix, tile after tile.
+
+	size_t Memory() const;
+};
+
+// Edit operation applied to every cell of an edited region: world position of the cell, and its
+// bedrock, sediment and vegetation values to modify.
+typedef std::function<void(const Vector2&, float&, float&, float&)> EditOperation;
+
+class DuneSediment;
+
+/*!
+\brief Operation run periodically by EndSimulationStep(). The work of a task with several slices is
+spread across steps: slice k runs k + 1 slices into each period, the last one on a multiple of the period.
+*/
+struct PeriodicTask
+{
+	typedef std::function<void(DuneSediment&, int, int)> Function;
+
+	std::string name;			//!< Name of the task, for reports.
+	int period = 0;				//!< Number of steps between two complete runs, 0 disables the task.
+	int slices = 1;				//!< Number of steps one run is spread across, at most the period.
+	Function function;			//!< Called with the simulation, the index of the slice and the number of slices.
+};
+
 class DuneSediment
 {
 private:
-	// 33 Degrees in radians
-	float tanThresholdAngleSediment = ToRadians(33.0f);		// ~33
+	// Tangents of the repose angles, unless a per-cell repose field is set
+	float tanThresholdAngleSediment = tanf(ToRadians(33.0f));	// ~33
 	float tanThresholdAngleWindShadowMin = ToRadians(10.0f);	// ~5
 	float tanThresholdAngleWindShadowMax = ToRadians(15.0f);	// ~15
-	float tanThresholdAngleBedrock = ToRadians(68.0f);		// ~68
+	float tanThresholdAngleBedrock = tanf(ToRadians(68.0f));	// ~68
+	bool sedimentReposeOn = false;
+	bool bedrockReposeOn = false;
+	static inline const ReposeTangents reposeTangents;
+	std::vector<SedimentClass> sedimentClasses;	//!< Grain size classes of the sand, empty for a single class.
+	float sedimentClassRepose[4] = { 0.0f };	//!< Tangents of the repose angles of the sediment classes.
+	float activeLayer = 0.5f;		//!< Sediment classes: thickness of the surface layer exchanging grains with the wind, in meter.
 
 	bool vegetationOn = false;
 	bool abrasionOn = false;
+	bool reptationOn = true;
+	bool shadowOn = true;
+	BoundaryMode boundary = BoundaryMode::Periodic;	//!< Toroidal by default, see SetBoundaryMode().
+	AvalancheMode avalanche = AvalancheMode::PerGrain;
+	ExecutionMode execution = ExecutionMode::OpenMP;
+	StepMode stepMode = StepMode::InPlace;
+	AuxiliaryMode auxiliaryMode = AuxiliaryMode::OnTheFly;
+	int auxiliaryThreads = 1;
+	bool auxiliaryValid = false;
+	int windRotation = 0;			//!< Number of counterclockwise quarter turns from the world frame to the simulation frame.
+	float relaxationTolerance = 0.001f;
+	int relaxationMaxIterations = 64;
+	GrainBudgetMode grainBudget = GrainBudgetMode::Grid;
+	float grainBudgetValue = 1.0f;
+	int lastGrainCount = 0;			//!< Number of grains lifted by the last simulation step, see GrainCount().
+	LiftOrder liftOrder = LiftOrder::Unsorted;
+	LiftSampling liftSampling = LiftSampling::Random;
+	TransportEngine engine = TransportEngine::Grains;
+	float turbulenceAmplitude = 0.0f;	//!< Typical speed of the turbulent wind, 0 without turbulence.
+	float turbulenceScale = 64.0f;		//!< Size of the largest eddies, in meter.
+	float turbulenceSpeed = 0.05f;		//!< Evolution of the eddies per simulation step, in noise periods.
+	int turbulenceOctaves = 3;
+	bool windSolverOn = false;
+	float windLayerHeight = 20.0f;	//!< Wind solver: thickness of the air layer above the mean terrain elevation, in meter.
+	bool sleepingTiles = false;
+	int sleepSteps = 10;			//!< Number of consecutive quiet steps after which a tile falls asleep.
+	int sleepRate = 8;				//!< A sleeping tile lifts one of sleepRate grains drawn in it.
+	float sleepMassTolerance = 0.5f;	//!< Largest change of the sediment mass of a quiet tile over a step, in meter.
+	float sleepSlopeTolerance = 0.05f;	//!< Largest excess of a quiet tile over the angle of repose of the sand, in meter.
+	int liftGrains = 0;				//!< Number of grains of the current step.
+	double liftOffset = 0.0;		//!< Random offset of the strata for the current step.
+	int liftStride = 1;				//!< Lattice and permutation samplings: stride between the cells of consecutive grains, coprime with the number of cells.
+	int liftShift = 0;				//!< Lattice and permutation samplings: cell of the first grain of the current step.
+	int stepCount = 0;
+	std::vector<PeriodicTask> periodicTasks = DefaultPeriodicTasks();
+	TerrainStatistics statistics;
+	TerrainStatistics pendingStatistics;
+	std::deque<EditRecord> history;	//!< Edits, oldest first.
+	int historyPosition = 0;		//!< Number of edits of the history currently applied, the following ones can be redone.
+	size_t historyMemory = 0;		//!< Memory used by the history, in bytes.
+	size_t historyCapacity = size_t(64) << 20;	//!< Memory cap of the history, in bytes.
 
 protected:
 	ScalarField2D bedrock;			//!< Bedrock elevation layer, in meter.
 	ScalarField2D sediments;		//!< Sediment elevation layer, in meter.
 	ScalarField2D vegetation;		//!< Vegetation presence in [0, 1].
+	ScalarField2D sedimentChanges;	//!< Two-phase step: changes of the sediment layer made by the transport, added at the end of the step.
+	ScalarField2D sedimentLifts;	//!< Two-phase step: sand lifted from each cell during the step, so that no cell is lifted beyond its sand.
+	ScalarField2D bedrockChanges;	//!< Two-phase step: abrasion of the bedrock during the step, added at the end of the step.
+	AuxiliaryFields auxiliary;		//!< Wind and shadows used by the current step, unless computed on the fly.
+	AuxiliaryFields nextAuxiliary;	//!< Pipelined auxiliary mode: wind and shadows being computed for the next step.
+	TaskGroup auxiliaryTasks;		//!< Pipelined auxiliary mode: tasks computing the wind and shadows of the next step.
+	ScalarField2D auxiliarySnapshot;	//!< Pipelined auxiliary mode: copy of the sediments of an in-place step, kept from one step to the next.
+	const ScalarField2D* auxiliarySand = nullptr;	//!< Pipelined auxiliary mode: sediments the next auxiliary fields are computed from, nullptr once handed to threads.
+	ScalarField2D relaxedHeight;	//!< Relaxation mode: total elevation at the beginning of a sweep.
+	ScalarField2D relaxedFlow;		//!< Relaxation mode: sand leaving each cell, per unit slope.
+	ScalarField2D relaxedSediments;	//!< Relaxation mode: sediment layer after a sweep.
+	ScalarField2D fluxAirborne;		//!< Flux engine: sand in the air after the last hop, in meter.
+	ScalarField2D fluxLanding;		//!< Flux engine: sand landing on each cell at the current hop, in meter.
+	ScalarField2D fluxDeposition;	//!< Flux engine: probability that a grain landing on each cell is deposited.
+	ScalarField2D turbulencePotential;	//!< Stream function of the turbulent wind of the current step, including the ghost cells.
+	ScalarField2D turbulenceX;		//!< Turbulent wind of the current step, x component.
+	ScalarField2D turbulenceY;		//!< Turbulent wind of the current step, y component.
+	ScalarField2D solvedWindX;		//!< Wind solver: wind of the coarse cells, x component.
+	ScalarField2D solvedWindY;		//!< Wind solver: wind of the coarse cells, y component.
+	std::vector<float> windPotential;	//!< Wind solver: velocity potential of the coarse cells, initial guess of the next solution.
+	ByteField2D sedimentRepose;		//!< Repose angle of the sand of every cell, quantized, see ReposeTangents.
+	ByteField2D bedrockRepose;		//!< Repose angle of the bedrock of every cell, quantized, see ReposeTangents.
+	ScalarField2D relaxedRepose;	//!< Relaxation mode: tangent of the repose angle of the sand of every cell, including the ghost cells.
+	Half4Field2D sedimentMix;		//!< Sediment classes: fractions of the classes in the active layer of every cell.
+	std::vector<double> threadBusyTimes;	//!< Time spent by each thread in the grain transport of the last step, in seconds.
+	std::vector<Vector2i> activeCells;	//!< Cells covered with sediments at the beginning of the step, unused with the grid budget.
+	std::vector<int> activeRows;		//!< Offsets of the rows of the grid in the active cells, gathered in parallel.
+	std::vector<Vector2i> liftSites;	//!< Tiled lift order: lift sites of the step, sorted by tile.
+	std::vector<int> liftBins;			//!< Tiled lift order: first lift site of each tile, tiles being sorted in Morton order.
+	std::vector<Vector2i> liftDrawn;	//!< Tiled lift order: lift sites of the step in the order of the grains, before the sort.
+	std::vector<int> liftKeys;			//!< Tiled lift order: tile of each drawn lift site.
+	std::vector<int> liftCounts;		//!< Tiled lift order: lift sites per tile and per thread, then their first slot in the sorted sites.
+	std::vector<unsigned char> abradedCells;	//!< Cells abraded since the last bedrock stabilization, one flag per cell.
+	std::vector<unsigned char> abradedTiles;	//!< Tiles of AbrasionTileSize² cells containing at least one abraded cell.
+	std::vector<float> tileMass;			//!< Sleeping tiles: sediment mass of each tile at the end of the last step, empty until measured.
+	std::vector<int> tileQuiet;				//!< Sleeping tiles: number of consecutive quiet steps of each tile.
+	std::vector<unsigned char> tileWake;	//!< Sleeping tiles: a grain landed in the sleeping tile during the step.
 
 	Box2D box;						//!< World space bounding box.
 	int nx, ny;						//!< Grid resolution.
 	float matterToMove;				//!< Amount of sand transported by the wind, in meter.
 	float cellSize;					//!< Size of one cell in meter, squared. Stored to speed up the simulation.
 	Vector2 wind;					//!< Base wind direction.
+	int offset8[8];					//!< Storage offsets of the 8 neighbours in the padded fields.
+	static const int AbrasionTileSize = 16;	//!< Size of the tiles used to find the abraded cells.
+	static const int LiftTileSize = 32;		//!< Size of the tiles used to sort the lift sites.
+	static const int EditTileSize = 32;		//!< Size of the tiles recorded by the edit history.
+	static const int SleepTileSize = 32;	//!< Size of the tiles whose activity is tracked.
+	static const int WindSolverStride = 8;	//!< Number of cells along the side of a coarse cell of the wind solver.
+	static const int MaxSedimentClasses = 4;	//!< Number of sediment classes packed in the cells of sedimentMix.
+
+	typedef void (DuneSediment::*StepKernel)();
+	StepKernel SelectStepKernel() const;
+	template<int... Features> static const StepKernel* StepKernels(std::integer_sequence<int, Features...>);
+	static TaskScheduler& Scheduler();
+	static std::vector<PeriodicTask> DefaultPeriodicTasks();
+	ScalarField2D& TransportedSediments();
+	ScalarField2D& TransportedBedrock();
+	bool ReserveLift(int id, float mass);
+	void ApplyStepChanges();
+	void PrepareAuxiliaryFields();
+	void RotateFrame(int quarterTurns);
+	void RotateReposeFields(int quarterTurns);
+	Vector2i WorldCell(int i, int j) const;
+	Vector2i FrameCell(int i, int j) const;
+	Vector2 FramePoint(const Vector2& p) const;
+	void WorldFields(ScalarField2D& rock, ScalarField2D& sand) const;
+	template<typename Policy> void TransportWind(int i, int j, Vector2& windDir) const;
+	template<typename Policy> float TransportShadow(int i, int j, const Vector2& windDir) const;
+	void ResetAbradedCells();
+	int PrepareGrainBudget();
+	void PrepareLiftSampling(int grains);
+	void DrawLiftSiteRange(int begin, int end, Vector2i* sites) const;
+	template<typename Cell> void DrawLiftSiteRange(int begin, int end, Vector2i* sites, int n, const Cell& cell) const;
+	int PrepareLiftSites(int grains);
+	void SimulationStepFlux();
+	void SolveWind();
+	float SedimentRepose(int i, int j) const;
+	float BedrockRepose(int i, int j) const;
+	template<typename Repose> int RelaxSedimentSweeps(const Repose& repose);
+	void ResetSedimentMix();
+	void InitialSedimentFractions(float* fractions) const;
+	int DrawSedimentClass(int i, int j) const;
+	void MixSedimentClasses(int i, int j, float height, const float* added, float mass);
+	double AdvectFlux();
+	void StabilizeBedrockPoints(std::vector<Vector2i>& points);
+	void ApplyEditRecord(const EditRecord& record);
+	int EditWords(int layer, int i, int j, uint32_t* words) const;
+	void SetEditWords(int layer, int i, int j, const uint32_t* words);
+	void ResetSleepingTiles();
+	void UpdateSleepingTiles();
+	int SleepTile(int i, int j) const;
+	bool SkipSleepingLift(const Vector2i& p) const;
+	void WakeTile(int i, int j);
 
 public:
 	DuneSediment();
@@ -40,18 +387,50 @@ public:
 	int ToIndex1D(const Vector2i& q) const;
 	int ToIndex1D(int i, int j) const;
 	void SimulationStepMultiThreadAtomic();
+	void BeginSimulationStep();
 	void EndSimulationStep();
-	void SimulationStepWorldSpace();
+	void SetTaskPeriod(int task, int period, int slices = 1);
+	int TaskPeriod(int task) const;
+	int AddPeriodicTask(const std::string& name, int period, int slices, const PeriodicTask::Function& function);
+	void GatherStatistics(int slice, int slices);
+	DuneSnapshot Snapshot(const DuneSnapshot* base = nullptr) const;
+	void Restore(const DuneSnapshot& snapshot);
+
+	// Edits
+	void Edit(const std::string& name, const Box2D& region, const EditOperation& operation);
+	void AddSediments(const Vector2& center, float radius, float height);
+	void AddBedrock(const Vector2& center, float radius, float height);
+	bool Undo();
+	bool Redo();
+	void ClearHistory();
+	void SetHistoryCapacity(size_t bytes);
+	template<typename Policy> void SimulationStepBatch();
+	template<typename Policy> void SimulationStepGrains(int batch, int grains);
+	template<typename Policy, bool Sleeping> void SimulationStepSites(const Vector2i* sites, int n);
+	template<typename Policy> Vector2i SimulationStepWorldSpace(int startI, int startJ);
 	void PerformReptationOnCell(int i, int j, int bounce);
+	template<typename Policy> void PerformReptationOnCell(int i, int j, int bounce);
 	void ComputeWindAtCell(int i, int j, Vector2& windDir) const;
+	void ComputeWindAtCell(const ScalarField2D& sand, int i, int j, Vector2& windDir) const;
 	float IsInShadow(int i, int j, const Vector2& wind) const;
+	float IsInShadow(const ScalarField2D& sand, int i, int j, const Vector2& wind, bool frozen = false) const;
+	void ComputeAuxiliaryRows(AuxiliaryFields& fields, const ScalarField2D& sand, int begin, int end, bool frozen = false) const;
+	void UpdateTurbulence();
+	std::vector<Vector2i> DrawLiftSites();
 	void SnapWorld(Vector2& p) const;
+	Vector2i SnapGrid(const Vector2i& q) const;
+	void RefreshGhostCells();
 	int CheckSedimentFlowRelative(const Vector2i& p, float tanThresholdAngle, Vector2i* nei, float* nslope) const;
+	int CheckSedimentFlowRelativeScalar(const Vector2i& p, float tanThresholdAngle, Vector2i* nei, float* nslope) const;
 	int CheckBedrockFlowRelative(const Vector2i& p, float tanThresholdAngle, Vector2i* nei, float * nslope) const;
 	void StabilizeSedimentRelative(int i, int j);
+	template<bool Classes> void StabilizeSedimentRelative(int i, int j);
+	template<bool Classes> void StabilizeSedimentQueue(std::vector<Vector2i>& queueToStabilize);
 	bool StabilizeBedrockRelative(int i, int j);
 	void StabilizeBedrockAll();
-	void PerformAbrasionOnCell(int i, int j, const Vector2& windDir);
+	void StabilizeBedrockSlice(int slice, int slices);
+	int RelaxSediments();
+	void PerformAbrasionOnCell(int i, int j, const Vector2& windDir, float events = 1.0f);
 
 	// Exports
 	void ExportObj(const std::string& file) const;
@@ -62,8 +441,46 @@ public:
 	float Height(const Vector2& p) const;
 	float Bedrock(int i, int j) const;
 	float Sediment(int i, int j) const;
+	float SedimentFraction(int i, int j, int c) const;
+	const ScalarField2D& BedrockField() const;
+	const ScalarField2D& SedimentField() const;
+	float SedimentReposeTangent() const;
+	Vector2 Wind() const;
+	Vector2 SolvedWind(int i, int j) const;
+	Vector2 TurbulentWind(int i, int j) const;
+	int AbradedCells() const;
+	size_t HistoryMemory() const;
+	int HistorySize() const;
 	void SetAbrasionMode(bool c);
 	void SetVegetationMode(bool c);
+	void SetReptationMode(bool c);
+	void SetShadowMode(bool c);
+	void SetAvalancheMode(AvalancheMode mode);
+	void SetRelaxationTolerance(float tolerance, int maxIterations);
+	void SetExecutionMode(ExecutionMode mode);
+	void SetStepMode(StepMode mode);
+	void SetAuxiliaryMode(AuxiliaryMode mode, int threads = 1);
+	bool SetWindAlignment(bool aligned);
+	void SetWind(const Vector2& w);
+	void SetGrainBudget(GrainBudgetMode mode, float value);
+	void SetLiftOrder(LiftOrder order);
+	void SetLiftSampling(LiftSampling sampling);
+	void SetTransportEngine(TransportEngine transport);
+	void SetTurbulence(float amplitude, float scale = 64.0f, float speed = 0.05f, int octaves = 3);
+	void SetWindSolver(bool solver, int period = 10, float layerHeight = 20.0f);
+	void SetSedimentRepose(const ScalarField2D& degrees);
+	void SetBedrockRepose(const ScalarField2D& degrees);
+	void ClearRepose();
+	void SetSedimentClasses(const std::vector<SedimentClass>& classes, float layer = 0.5f);
+	void SetSleepingTiles(bool sleeping);
+	void SetSleepThresholds(int steps, int rate, float massTolerance, float slopeTolerance);
+	int SleepingTiles() const;
+	int SleepTileCount() const;
+	const std::vector<double>& ThreadBusyTimes() const;
+	int GrainCount() const;
+	int StepCount() const;
+	const TerrainStatistics& Statistics() const;
+	void SetBoundaryMode(BoundaryMode mode);
 };
 
 /*!
@@ -84,12 +501,27 @@ inline int DuneSediment::ToIndex1D(const Vector2i& q) const
 	return bedrock.ToIndex1D(q);
 }
 
+/*!
+\brief Returns the cell of the simulation frame storing a given cell of the world frame.
+*/
+inline Vector2i DuneSediment::FrameCell(int i, int j) const
+{
+	for (int k = 0; k < windRotation; k++)
+	{
+		const int t = i;
+		i = j;
+		j = nx - 1 - t;
+	}
+	return Vector2i(i, j);
+}
+
 /*!
 \brief
 */
 inline float DuneSediment::Height(int i, int j) const
 {
-	return bedrock.Get(i, j) + sediments.Get(i, j);
+	const Vector2i q = FrameCell(i, j);
+	return bedrock.Get(q.x, q.y) + sediments.Get(q.x, q.y);
 }
 
 /*!
@@ -97,7 +529,7 @@ inline float DuneSediment::Height(int i, int j) const
 */
 inline float DuneSediment::Height(const Vector2& p) const 
 {
-	return bedrock.GetValueBilinear(p) + sediments.GetValueBilinear(p);
+	return ScalarField2D::GetValueBilinearSum(bedrock, sediments, FramePoint(p));
 }
 
 /*!
@@ -105,7 +537,8 @@ inline float DuneSediment::Height(const Vector2& p) const
 */
 inline float DuneSediment::Bedrock(int i, int j) const
 {
-	return bedrock.Get(i, j);
+	const Vector2i q = FrameCell(i, j);
+	return bedrock.Get(q.x, q.y);
 }
 
 /*!
@@ -113,7 +546,82 @@ inline float DuneSediment::Bedrock(int i, int j) const
 */
 inline float DuneSediment::Sediment(int i, int j) const
 {
-	return sediments.Get(i, j);
+	const Vector2i q = FrameCell(i, j);
+	return sediments.Get(q.x, q.y);
+}
+
+/*!
+\brief Returns the share of a sediment class in the active layer of a given cell, 1 for the single class.
+*/
+inline float DuneSediment::SedimentFraction(int i, int j, int c) const
+{
+	if (sedimentClasses.empty())
+		return 1.0f;
+	const Vector2i q = FrameCell(i, j);
+	float f[MaxSedimentClasses];
+	sedimentMix.Get(q.x, q.y).ToFloats(f);
+	return f[c];
+}
+
+/*!
+\brief Returns the bedrock layer, in the simulation frame.
+*/
+inline const ScalarField2D& DuneSediment::BedrockField() const
+{
+	return bedrock;
+}
+
+/*!
+\brief Returns the sediment layer, in the simulation frame.
+*/
+inline const ScalarField2D& DuneSediment::SedimentField() const
+{
+	return sediments;
+}
+
+/*!
+\brief Returns the tangent of the uniform repose angle of the sand, used unless repose fields or sediment classes are set.
+*/
+inline float DuneSediment::SedimentReposeTangent() const
+{
+	return tanThresholdAngleSediment;
+}
+
+/*!
+\brief Returns the base wind, in the world frame.
+*/
+inline Vector2 DuneSediment::Wind() const
+{
+	Vector2 w = wind;
+	for (int k = 0; k < windRotation; k++)
+		w = Vector2(w.y, -w.x);
+	return w;
+}
+
+/*!
+\brief Returns the turbulent wind of the current step at a given cell of the simulation frame, zero without turbulence.
+*/
+inline Vector2 DuneSediment::TurbulentWind(int i, int j) const
+{
+	if (turbulenceAmplitude <= 0.0f)
+		return Vector2(0.0f);
+	return Vector2(turbulenceX.Get(i, j), turbulenceY.Get(i, j));
+}
+
+/*!
+\brief Returns the memory used by the edit history, in bytes.
+*/
+inline size_t DuneSediment::HistoryMemory() const
+{
+	return historyMemory;
+}
+
+/*!
+\brief Returns the number of edits kept by the history, including the ones that can be redone.
+*/
+inline int DuneSediment::HistorySize() const
+{
+	return int(history.size());
 }
 
 /*!
@@ -131,3 +639,317 @@ inline void DuneSediment::SetVegetationMode(bool c)
 {
 	vegetationOn = c;
 }
+
+/*!
+\brief
+*/
+inline void DuneSediment::SetReptationMode(bool c)
+{
+	reptationOn = c;
+}
+
+/*!
+\brief
+*/
+inline void DuneSediment::SetShadowMode(bool c)
+{
+	shadowOn = c;
+}
+
+/*!
+\brief Change the way sand avalanches are resolved.
+*/
+inline void DuneSediment::SetAvalancheMode(AvalancheMode mode)
+{
+	avalanche = mode;
+}
+
+/*!
+\brief Change the stopping criterion of the relaxation avalanche mode.
+\param tolerance the relaxation stops when no cell moves more sand than this height, in meter.
+\param maxIterations maximum number of sweeps per simulation step.
+*/
+inline void DuneSediment::SetRelaxationTolerance(float tolerance, int maxIterations)
+{
+	relaxationTolerance = tolerance;
+	relaxationMaxIterations = maxIterations;
+}
+
+/*!
+\brief Change the way grains are distributed between threads.
+*/
+inline void DuneSediment::SetExecutionMode(ExecutionMode mode)
+{
+	execution = mode;
+}
+
+/*!
+\brief Change the number of grains lifted by each simulation step.
+\param mode the way the number of grains is computed
+\param value number of grains with GrainBudgetMode::Absolute, grains per sand covered cell with GrainBudgetMode::PerActiveCell,
+grains per lifted amount of sand with GrainBudgetMode::MobileMass. Unused with GrainBudgetMode::Grid.
+*/
+inline void DuneSediment::SetGrainBudget(GrainBudgetMode mode, float value)
+{
+	grainBudget = mode;
+	grainBudgetValue = value;
+}
+
+/*!
+\brief Change the order in which the grains of a step are processed.
+*/
+inline void DuneSediment::SetLiftOrder(LiftOrder order)
+{
+	liftOrder = order;
+}
+
+/*!
+\brief Change the distribution of the lift sites within a step.
+*/
+inline void DuneSediment::SetLiftSampling(LiftSampling sampling)
+{
+	liftSampling = sampling;
+}
+
+/*!
+\brief Change the transport of the sand: stochastic detail of the grains, or speed and reproducibility of the flux.
+*/
+inline void DuneSediment::SetTransportEngine(TransportEngine transport)
+{
+	engine = transport;
+	auxiliaryValid = false;
+}
+
+/*!
+\brief Add a turbulent layer to the wind, evolving from one step to the next.
+The turbulence is the curl of a fractal noise: its eddies neither create nor swallow sand.
+\param amplitude typical speed of the turbulent wind, in the units of the base wind, 0 to turn turbulence off
+\param scale size of the largest eddies, in meter
+\param speed evolution of the eddies per simulation step, in noise periods
+\param octaves number of noise octaves, each octave halves the size and the speed of the eddies
+*/
+inline void DuneSediment::SetTurbulence(float amplitude, float scale, float speed, int octaves)
+{
+	turbulenceAmplitude = amplitude;
+	turbulenceScale = scale;
+	turbulenceSpeed = speed;
+	turbulenceOctaves = octaves;
+	auxiliaryValid = false;
+	UpdateTurbulence();
+}
+
+/*!
+\brief Sample the wind of the coarse solver at a given cell, with a bilinear interpolation between the centers of the coarse cells.
+*/
+inline Vector2 DuneSediment::SolvedWind(int i, int j) const
+{
+	const int n = solvedWindX.SizeX();
+	const int m = solvedWindX.SizeY();
+	const float u = (float(i) + 0.5f) / float(WindSolverStride) - 0.5f;
+	const float v = (float(j) + 0.5f) / float(WindSolverStride) - 0.5f;
+	const int i0 = int(floorf(u));
+	const int j0 = int(floorf(v));
+	const float du = u - float(i0);
+	const float dv = v - float(j0);
+	const int ia = ScalarField2D::GhostSource(i0, n, boundary);
+	const int ib = ScalarField2D::GhostSource(i0 + 1, n, boundary);
+	const int ja = ScalarField2D::GhostSource(j0, m, boundary);
+	const int jb = ScalarField2D::GhostSource(j0 + 1, m, boundary);
+	const float wa = (1.0f - du) * (1.0f - dv);
+	const float wb = (1.0f - du) * dv;
+	const float wc = du * (1.0f - dv);
+	const float wd = du * dv;
+	return Vector2(wa * solvedWindX.Get(ia, ja) + wb * solvedWindX.Get(ia, jb) + wc * solvedWindX.Get(ib, ja) + wd * solvedWindX.Get(ib, jb),
+		wa * solvedWindY.Get(ia, ja) + wb * solvedWindY.Get(ia, jb) + wc * solvedWindY.Get(ib, ja) + wd * solvedWindY.Get(ib, jb));
+}
+
+/*!
+\brief Returns the tangent of the repose angle of the sand at a given cell. The uniform angle needs no extra load.
+A per-cell repose field takes precedence over the mix of the sediment classes.
+*/
+inline float DuneSediment::SedimentRepose(int i, int j) const
+{
+	if (!sedimentReposeOn && sedimentClasses.empty())
+		return tanThresholdAngleSediment;
+	if (sedimentReposeOn)
+		return reposeTangents.tangent[sedimentRepose.Get(i, j)];
+	float f[MaxSedimentClasses];
+	sedimentMix.Get(i, j).ToFloats(f);
+	return f[0] * sedimentClassRepose[0] + f[1] * sedimentClassRepose[1] + f[2] * sedimentClassRepose[2] + f[3] * sedimentClassRepose[3];
+}
+
+/*!
+\brief Returns the tangent of the repose angle of the bedrock at a given cell. The uniform angle needs no extra load.
+*/
+inline float DuneSediment::BedrockRepose(int i, int j) const
+{
+	if (!bedrockReposeOn)
+		return tanThresholdAngleBedrock;
+	return reposeTangents.tangent[bedrockRepose.Get(i, j)];
+}
+
+/*!
+\brief Replace the local speed-up of the wind by a wind field solved over a coarse grid, refreshed periodically.
+The slope of each cell still deflects the wind locally.
+\param solver true to turn the wind solver on
+\param period number of steps between two solutions, see WindSolverTask
+\param layerHeight thickness of the air layer above the mean terrain elevation, in meter: the thinner, the stronger the speed-up on crests
+*/
+inline void DuneSediment::SetWindSolver(bool solver, int period, float layerHeight)
+{
+	windSolverOn = solver;
+	windLayerHeight = layerHeight;
+	SetTaskPeriod(WindSolverTask, period);
+	auxiliaryValid = false;
+	if (windSolverOn)
+		SolveWind();
+}
+
+/*!
+\brief Change the organization of the reads and writes of the simulation steps.
+*/
+inline void DuneSediment::SetStepMode(StepMode mode)
+{
+	stepMode = mode;
+}
+
+/*!
+\brief Change the computation of the wind and wind shadowing used by the grain transport.
+\param mode computation mode
+\param threads number of threads computing the auxiliary fields of the next step in the pipelined mode,
+these threads are taken from the transport: the OpenMP team, or the tasks of the work stealing pool
+*/
+inline void DuneSediment::SetAuxiliaryMode(AuxiliaryMode mode, int threads)
+{
+	auxiliaryMode = mode;
+	auxiliaryThreads = threads;
+	auxiliaryValid = false;
+}
+
+/*!
+\brief Change the base wind, for instance in a branch restored from a snapshot. The simulation frame is kept,
+call SetWindAlignment() to align it with the new wind.
+\param w wind, in the world frame
+*/
+inline void DuneSediment::SetWind(const Vector2& w)
+{
+	wind = w;
+	for (int k = 0; k < windRotation; k++)
+		wind = Vector2(-wind.y, wind.x);
+	auxiliaryValid = false;
+}
+
+/*!
+\brief Turn the tracking of the activity of the tiles on or off. Tiles whose sediment mass and slopes stay steady
+for a number of steps fall asleep: grains drawn in them are only lifted at a reduced rate, until a grain lands
+in the tile. Speeds up mature scenes, where bare interdunes and sheltered areas barely change.
+*/
+inline void DuneSediment::SetSleepingTiles(bool sleeping)
+{
+	sleepingTiles = sleeping;
+	ResetSleepingTiles();
+}
+
+/*!
+\brief Change the criteria of the sleeping tiles.
+\param steps number of consecutive quiet steps after which a tile falls asleep
+\param rate a sleeping tile lifts one of rate grains drawn in it
+\param massTolerance largest change of the sediment mass of a quiet tile over a step, in meter
+\param slopeTolerance largest excess of a quiet tile over the angle of repose of the sand, in meter
+*/
+inline void DuneSediment::SetSleepThresholds(int steps, int rate, float massTolerance, float slopeTolerance)
+{
+	sleepSteps = Math::Max(steps, 1);
+	sleepRate = Math::Max(rate, 1);
+	sleepMassTolerance = massTolerance;
+	sleepSlopeTolerance = slopeTolerance;
+}
+
+/*!
+\brief Returns the tile whose activity is tracked containing a given cell.
+*/
+inline int DuneSediment::SleepTile(int i, int j) const
+{
+	return (i / SleepTileSize) * ((ny + SleepTileSize - 1) / SleepTileSize) + j / SleepTileSize;
+}
+
+/*!
+\brief Check whether a grain drawn at a given lift site is skipped because its tile sleeps.
+Only called when the sleeping tiles are turned on.
+*/
+inline bool DuneSediment::SkipSleepingLift(const Vector2i& p) const
+{
+	return tileQuiet[SleepTile(p.x, p.y)] >= sleepSteps && Random::Integer() % sleepRate != 0;
+}
+
+/*!
+\brief Wake the tile of a cell up at the end of the step if it sleeps, called when a grain lands in the cell.
+Only called when the sleeping tiles are turned on. Can be called concurrently from several threads.
+*/
+inline void DuneSediment::WakeTile(int i, int j)
+{
+	const int t = SleepTile(i, j);
+	if (tileQuiet[t] >= sleepSteps)
+		Atomic::Store(tileWake[t], (unsigned char)(1));
+}
+
+/*!
+\brief Returns the sediment layer the grain transport writes to: the layer itself,
+or the changes of the two-phase step.
+*/
+inline ScalarField2D& DuneSediment::TransportedSediments()
+{
+	return stepMode == StepMode::TwoPhase ? sedimentChanges : sediments;
+}
+
+/*!
+\brief Returns the bedrock layer abrasion writes to: the layer itself, or the changes of the two-phase step.
+*/
+inline ScalarField2D& DuneSediment::TransportedBedrock()
+{
+	return stepMode == StepMode::TwoPhase ? bedrockChanges : bedrock;
+}
+
+/*!
+\brief Returns the time spent by each thread transporting grains during the last simulation step, in seconds.
+*/
+inline const std::vector<double>& DuneSediment::ThreadBusyTimes() const
+{
+	return threadBusyTimes;
+}
+
+/*!
+\brief Returns the number of grains lifted by the last simulation step, which depends on the grain budget.
+*/
+inline int DuneSediment::GrainCount() const
+{
+	return lastGrainCount;
+}
+
+/*!
+\brief Returns the number of simulation steps performed since the construction of the terrain.
+*/
+inline int DuneSediment::StepCount() const
+{
+	return stepCount;
+}
+
+/*!
+\brief Returns the last complete statistics of the terrain, see StatisticsTask.
+*/
+inline const TerrainStatistics& DuneSediment::Statistics() const
+{
+	return statistics;
+}
+
+/*!
+\brief Change the boundary condition of the terrain, used by saltation and by neighbour stencils.
+The default periodic domain wraps the grains and the wind shadows across the edges as the original simulation did,
+and lets avalanches cross the edges too, where the original neighbour loops ignored the cells outside of the grid.
+The clamped domain stops both the avalanches and the grains at the edges.
+*/
+inline void DuneSediment::SetBoundaryMode(BoundaryMode mode)
+{
+	boundary = mode;
+	RefreshGhostCells();
+}
@@ -98,6 +98,44 @@ public:
 		return Math::Lerp(l5, l6, w);
 	}
 
+	// Same as GetValue() at n points of a plane z = constant, without branches so that the loop is vectorized.
+	static inline void GetValues(const float* x, const float* y, float z, float* values, int n)
+	{
+		const float fz = floorf(z);
+		const int unit_z = int(fz) & 255;
+		z = z - fz;
+		const float w = Math::QuinticSmooth(z);
+
+#pragma omp simd
+		for (int k = 0; k < n; k++)
+		{
+			// Floor, cubes in the quintic fade: the library calls are not vectorized
+			const int tx = int(x[k]);
+			const int ty = int(y[k]);
+			const int ix = tx - (x[k] < float(tx) ? 1 : 0);
+			const int iy = ty - (y[k] < float(ty) ? 1 : 0);
+			const int unit_x = ix & 255;
+			const int unit_y = iy & 255;
+			const float rx = x[k] - float(ix);
+			const float ry = y[k] - float(iy);
+			const float u = rx * rx * rx * (rx * (rx * 6.0f - 15.0f) + 10.0f);
+			const float v = ry * ry * ry * (ry * (ry * 6.0f - 15.0f) + 10.0f);
+
+			const int a = Perm[unit_x] + unit_y;
+			const int aa = Perm[a] + unit_z;
+			const int ab = Perm[a + 1] + unit_z;
+			const int b = Perm[unit_x + 1] + unit_y;
+			const int ba = Perm[b] + unit_z;
+			const int bb = Perm[b + 1] + unit_z;
+
+			const float l1 = Math::Lerp(Gradient(Perm[aa], rx, ry, z), Gradient(Perm[ba], rx - 1, ry, z), u);
+			const float l2 = Math::Lerp(Gradient(Perm[ab], rx, ry - 1, z), Gradient(Perm[bb], rx - 1, ry - 1, z), u);
+			const float l3 = Math::Lerp(Gradient(Perm[aa + 1], rx, ry, z - 1), Gradient(Perm[ba + 1], rx - 1, ry, z - 1), u);
+			const float l4 = Math::Lerp(Gradient(Perm[ab + 1], rx, ry - 1, z - 1), Gradient(Perm[bb + 1], rx - 1, ry - 1, z - 1), u);
+			values[k] = Math::Lerp(Math::Lerp(l1, l2, v), Math::Lerp(l3, l4, v), w);
+		}
+	}
+
 	static inline float fBm(const Vector3& p, float a, float f, int o)
 	{
 		float ret = 0.0f;
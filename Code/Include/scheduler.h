@@ -0,0 +1,249 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// TaskGroup. Set of tasks spawned together and waited for together, see TaskScheduler::Wait(). Tasks spawned by
+// a running task join its group. Waiting for a group does not wait for the tasks of the other groups sharing the pool.
+class TaskGroup
+{
+	friend class TaskScheduler;
+
+protected:
+	std::atomic<int> pending{ 0 };	//!< Number of tasks of the group not yet completed.
+	std::vector<double> busyTimes;	//!< Time spent by each worker on the tasks of the group, each worker writes its own entry.
+
+public:
+	TaskGroup() = default;
+
+	/*!
+	\brief Copy constructor. The copy is an empty group: copies of an object owning a group do not share its tasks.
+	*/
+	inline TaskGroup(const TaskGroup&)
+	{
+	}
+
+	/*!
+	\brief Assignment, leaves the group unchanged, see the copy constructor.
+	*/
+	inline TaskGroup& operator=(const TaskGroup&)
+	{
+		return *this;
+	}
+
+	/*!
+	\brief Returns the time each worker spent executing the tasks of the group since it was last spawned from outside
+	of the pool with no task pending, in seconds. Complete once the group has been waited for.
+	*/
+	inline const std::vector<double>& BusyTimes() const
+	{
+		return busyTimes;
+	}
+};
+
+// TaskScheduler. A pool of worker threads executing tasks with work stealing: each worker owns a deque,
+// pops its own tasks in LIFO order and steals the oldest tasks of the other workers when it runs out of work.
+// Tasks can spawn other tasks, which makes it possible to split long irregular jobs while they execute.
+// Tasks belong to groups, so that independent users of the pool can each wait for their own tasks.
+class TaskScheduler
+{
+public:
+	typedef std::function<void()> Task;
+
+protected:
+	// Task and the group it belongs to.
+	struct Job
+	{
+		Task task;
+		TaskGroup* group = nullptr;
+	};
+
+	// Per worker deque, padded to avoid false sharing between workers.
+	struct Worker
+	{
+		std::mutex mutex;
+		std::deque<Job> jobs;
+		char padding[64];
+	};
+
+	std::vector<std::thread> threads;
+	std::vector<Worker> workers;
+	std::atomic<int> queued;			//!< Number of spawned tasks not yet taken by a worker.
+	std::atomic<int> sleeping;			//!< Number of workers waiting for new tasks.
+	std::atomic<int> next;				//!< Round robin counter for tasks spawned from outside of the pool.
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::condition_variable done;
+	bool stop = false;
+
+	static int& CurrentIndex()
+	{
+		static thread_local int index = -1;
+		return index;
+	}
+
+	static TaskGroup*& CurrentGroup()
+	{
+		static thread_local TaskGroup* group = nullptr;
+		return group;
+	}
+
+public:
+	/*!
+	\brief Constructor.
+	\param n number of worker threads
+	*/
+	inline explicit TaskScheduler(int n) : workers(n), queued(0), sleeping(0), next(0)
+	{
+		for (int i = 0; i < n; i++)
+			threads.push_back(std::thread(&TaskScheduler::Run, this, i));
+	}
+
+	/*!
+	\brief Destructor, waits for the workers to terminate.
+	*/
+	inline ~TaskScheduler()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		wakeUp.notify_all();
+		for (int i = 0; i < int(threads.size()); i++)
+			threads[i].join();
+	}
+
+	/*!
+	\brief Add a task of a group to the pool. Tasks spawned by a worker go to its own deque, others are distributed round robin.
+	Spawning from outside of the pool a group with no pending task resets its busy times.
+	*/
+	inline void Spawn(TaskGroup& group, Task task)
+	{
+		int w = CurrentWorker();
+		if (w < 0 && group.pending == 0)
+			group.busyTimes.assign(workers.size(), 0.0);
+		group.pending++;
+		if (w < 0)
+			w = next++ % int(workers.size());
+		{
+			std::lock_guard<std::mutex> lock(workers[w].mutex);
+			workers[w].jobs.push_back(Job{ std::move(task), &group });
+		}
+		queued++;
+		if (sleeping > 0)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			wakeUp.notify_one();
+		}
+	}
+
+	/*!
+	\brief Add a task to the group of the running task. Must be called from a worker.
+	*/
+	inline void Spawn(Task task)
+	{
+		Spawn(*CurrentGroup(), std::move(task));
+	}
+
+	/*!
+	\brief Block until all the tasks of a group, including the ones they spawned, are completed.
+	Must not be called from a worker.
+	*/
+	inline void Wait(TaskGroup& group)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&group]() { return group.pending == 0; });
+	}
+
+	/*!
+	\brief Returns the index of the worker running the calling thread, or -1 outside of the pool.
+	*/
+	static inline int CurrentWorker()
+	{
+		return CurrentIndex();
+	}
+
+	/*!
+	\brief Returns the number of worker threads.
+	*/
+	inline int Threads() const
+	{
+		return int(workers.size());
+	}
+
+protected:
+	/*!
+	\brief Take a task from the back of the deque of the given worker.
+	*/
+	inline bool Pop(int w, Job& job)
+	{
+		std::lock_guard<std::mutex> lock(workers[w].mutex);
+		if (workers[w].jobs.empty())
+			return false;
+		job = std::move(workers[w].jobs.back());
+		workers[w].jobs.pop_back();
+		queued--;
+		return true;
+	}
+
+	/*!
+	\brief Take the oldest task of another worker, visiting them in turn starting after the thief.
+	*/
+	inline bool Steal(int w, Job& job)
+	{
+		const int n = int(workers.size());
+		for (int k = 1; k < n; k++)
+		{
+			Worker& victim = workers[(w + k) % n];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (victim.jobs.empty())
+				continue;
+			job = std::move(victim.jobs.front());
+			victim.jobs.pop_front();
+			queued--;
+			return true;
+		}
+		return false;
+	}
+
+	/*!
+	\brief Main loop of a worker thread.
+	*/
+	inline void Run(int w)
+	{
+		CurrentIndex() = w;
+		while (true)
+		{
+			Job job;
+			if (Pop(w, job) || Steal(w, job))
+			{
+				auto start = std::chrono::high_resolution_clock::now();
+				CurrentGroup() = job.group;
+				job.task();
+				CurrentGroup() = nullptr;
+				job.group->busyTimes[w] += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+				if (--job.group->pending == 0)
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					done.notify_all();
+				}
+				continue;
+			}
+
+			// Sleep until a task is spawned: running tasks that spawn work wake the sleepers up,
+			// so idle workers do not compete for the cores with the threads doing the work
+			std::unique_lock<std::mutex> lock(mutex);
+			if (stop)
+				return;
+			sleeping++;
+			wakeUp.wait(lock, [this]() { return stop || queued > 0; });
+			sleeping--;
+		}
+	}
+};
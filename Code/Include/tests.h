@@ -0,0 +1,7 @@
+#pragma once
+
+// Regression tests of the simulation, run with the "test" argument. Each test prints its outcome and returns true on success.
+bool TestGhostRefresh();
+bool TestMassConservation();
+bool TestSedimentMix();
+bool TestSnapshotRestore();
@@ -0,0 +1,868 @@
+#include "benchmark.h"
+#include "desert.h"
+#include "noise.h"
+
+#include <chrono>
+#include <omp.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define OMP_NUM_THREAD 8
+
+/*!
+\brief Measure the wall clock time of a function, in seconds.
+*/
+template<typename Function>
+static double Timing(Function f)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	f();
+	auto end = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<double>(end - start).count();
+}
+
+/*!
+\brief Cache and data TLB miss counters of the calling thread, read from the hardware performance counters
+when the platform exposes them (Linux perf events).
+*/
+class MissCounters
+{
+protected:
+	int fd[2] = { -1, -1 };
+
+public:
+	long long misses[2] = { 0, 0 };	//!< Cache and TLB misses counted between Open() and Close().
+
+	/*!
+	\brief Start counting on the calling thread.
+	*/
+	inline void Open()
+	{
+#ifdef __linux__
+		const unsigned long long configs[2] = {
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) };
+		const unsigned int types[2] = { PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE };
+		for (int c = 0; c < 2; c++)
+		{
+			perf_event_attr attr = perf_event_attr();
+			attr.type = types[c];
+			attr.size = sizeof(perf_event_attr);
+			attr.config = configs[c];
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			fd[c] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+		}
+#endif
+	}
+
+	/*!
+	\brief Stop counting on the calling thread.
+	\return false if the counters are not available
+	*/
+	inline bool Close()
+	{
+		bool available = true;
+		for (int c = 0; c < 2; c++)
+		{
+			if (fd[c] < 0)
+			{
+				available = false;
+				continue;
+			}
+#ifdef __linux__
+			if (read(fd[c], &misses[c], sizeof(misses[c])) != sizeof(misses[c]))
+				misses[c] = 0;
+			close(fd[c]);
+#endif
+			fd[c] = -1;
+		}
+		return available;
+	}
+};
+
+/*!
+\brief Run the same number of simulation steps from copies of a terrain set up in different modes, and report
+the time per step and the sediment budget of each mode.
+\param terrain initial terrain
+\param title compared setting, printed before the name of each mode
+\param names names of the modes
+\param modes number of modes
+\param steps number of simulation steps per mode
+\param setup function setting a copy of the terrain up in a given mode, called right before the timed steps
+\param report function printing the other measures of a mode after its steps
+*/
+template<typename Setup, typename Report>
+static void CompareModes(const DuneSediment& terrain, const char* title, const char* const* names, int modes, int steps, const Setup& setup, const Report& report)
+{
+	for (int m = 0; m < modes; m++)
+	{
+		DuneSediment dune = terrain;
+		setup(dune, m);
+		double t = Timing([&]()
+		{
+			for (int i = 0; i < steps; i++)
+				dune.SimulationStepMultiThreadAtomic();
+		});
+		dune.GatherStatistics(0, 1);
+		std::cout << title << " (" << names[m] << "): " << 1000.0 * t / steps << " ms/step, sediments " << dune.Statistics().sediments;
+		report(dune, m);
+		std::cout << std::endl;
+	}
+}
+
+/*!
+\brief Compare modes on the time per step and the sediment budget only, see above.
+*/
+template<typename Setup>
+static void CompareModes(const DuneSediment& terrain, const char* title, const char* const* names, int modes, int steps, const Setup& setup)
+{
+	CompareModes(terrain, title, names, modes, steps, setup, [](const DuneSediment&, int) {});
+}
+
+/*!
+\brief Measure the throughput of the flow direction kernels on a terrain, in cells per second.
+Also checks that the vectorized kernel returns the same results as the scalar one.
+*/
+void BenchmarkFlowDirections(const DuneSediment& terrain)
+{
+	typedef int (DuneSediment::*FlowFunction)(const Vector2i&, float, Vector2i*, float*) const;
+	const int passes = 10;
+	const int nx = terrain.SedimentField().SizeX();
+	const int ny = terrain.SedimentField().SizeY();
+	const float tanThresholdAngle = terrain.SedimentReposeTangent();
+	Vector2i nei[8], neiRef[8];
+	float nslope[8], nslopeRef[8];
+
+	// Validation
+	int mismatches = 0;
+	for (int i = 0; i < nx; i++)
+	{
+		for (int j = 0; j < ny; j++)
+		{
+			int n = terrain.CheckSedimentFlowRelative(Vector2i(i, j), tanThresholdAngle, nei, nslope);
+			int nRef = terrain.CheckSedimentFlowRelativeScalar(Vector2i(i, j), tanThresholdAngle, neiRef, nslopeRef);
+			bool same = (n == nRef);
+			for (int k = 0; k < n && same; k++)
+				same = nei[k].x == neiRef[k].x && nei[k].y == neiRef[k].y && nslope[k] == nslopeRef[k];
+			if (!same)
+				mismatches++;
+		}
+	}
+	std::cout << "Flow directions: " << mismatches << " mismatching cells" << std::endl;
+
+	// Throughput
+	const FlowFunction kernels[2] = { &DuneSediment::CheckSedimentFlowRelativeScalar, &DuneSediment::CheckSedimentFlowRelative };
+	const char* names[2] = { "scalar", "default" };
+	for (int f = 0; f < 2; f++)
+	{
+		int flows = 0;
+		double t = Timing([&]()
+		{
+			for (int pass = 0; pass < passes; pass++)
+			{
+				for (int i = 0; i < nx; i++)
+				{
+					for (int j = 0; j < ny; j++)
+						flows += (terrain.*kernels[f])(Vector2i(i, j), tanThresholdAngle, nei, nslope);
+				}
+			}
+		});
+		std::cout << "Flow directions (" << names[f] << "): " << double(passes) * nx * ny / t / 1e6 << " Mcells/s (" << flows << " flows)" << std::endl;
+	}
+}
+
+/*!
+\brief Compare the time per simulation step of the in-place and two-phase steps, starting from a terrain.
+Avalanches of the in-place step are resolved per grain, then by relaxation as in the two-phase step.
+\param steps number of simulation steps per mode
+*/
+void BenchmarkStepMode(const DuneSediment& terrain, int steps)
+{
+	const StepMode modes[3] = { StepMode::InPlace, StepMode::InPlace, StepMode::TwoPhase };
+	const AvalancheMode avalanches[3] = { AvalancheMode::PerGrain, AvalancheMode::Relaxation, AvalancheMode::Relaxation };
+	const char* names[3] = { "in place, per grain", "in place, relaxation", "two-phase" };
+	CompareModes(terrain, "Step mode", names, 3, steps, [&](DuneSediment& dune, int m)
+	{
+		dune.SetStepMode(modes[m]);
+		dune.SetAvalancheMode(avalanches[m]);
+	});
+}
+
+/*!
+\brief Compute the wind and shadows of the whole grid of a terrain on one thread, and return the time in seconds.
+*/
+static double TimeAuxiliaryFields(const DuneSediment& dune)
+{
+	const ScalarField2D& sand = dune.SedimentField();
+	AuxiliaryFields fields;
+	fields.windX = ScalarField2D(sand.SizeX(), sand.SizeY(), sand.GetBox(), 0.0f, GhostBorder{ 1 });
+	fields.windY = ScalarField2D(sand.SizeX(), sand.SizeY(), sand.GetBox(), 0.0f, GhostBorder{ 1 });
+	fields.shadow = ScalarField2D(sand.SizeX(), sand.SizeY(), sand.GetBox(), 0.0f, GhostBorder{ 1 });
+	return Timing([&]() { dune.ComputeAuxiliaryRows(fields, sand, 0, sand.SizeX(), true); });
+}
+
+/*!
+\brief Compare the time per simulation step of the auxiliary modes, starting from a terrain.
+Also reports the time needed to compute the auxiliary fields of the whole grid on one thread.
+\param steps number of simulation steps per mode
+*/
+void BenchmarkAuxiliaryMode(const DuneSediment& terrain, int steps)
+{
+	std::cout << "Auxiliary fields: " << 1000.0 * TimeAuxiliaryFields(terrain) << " ms on one thread" << std::endl;
+
+	const AuxiliaryMode modes[3] = { AuxiliaryMode::OnTheFly, AuxiliaryMode::Precomputed, AuxiliaryMode::Pipelined };
+	const char* names[3] = { "on the fly", "precomputed", "pipelined" };
+	CompareModes(terrain, "Auxiliary mode", names, 3, steps,
+		[&](DuneSediment& dune, int m) { dune.SetAuxiliaryMode(modes[m]); },
+		[](const DuneSediment& dune, int) { std::cout << ", max height " << dune.Statistics().maxHeight; });
+}
+
+/*!
+\brief Compare the simulation in the world frame and in the wind aligned frame, starting from a terrain.
+Reports the time per step and the time of the wind and shadow computation over the whole grid, which marches along the wind.
+\param steps number of simulation steps per frame
+*/
+void BenchmarkWindAlignment(const DuneSediment& terrain, int steps)
+{
+	const char* names[2] = { "world frame", "wind aligned frame" };
+	double auxiliary[2];
+	CompareModes(terrain, "Wind alignment", names, 2, steps,
+		[&](DuneSediment& dune, int m)
+		{
+			if (dune.SetWindAlignment(m == 1) != (m == 1))
+				std::cout << "Wind alignment: the grid is not square, the aligned frame is the world frame" << std::endl;
+			auxiliary[m] = TimeAuxiliaryFields(dune);
+		},
+		[&](const DuneSediment&, int m) { std::cout << ", wind and shadows " << 1000.0 * auxiliary[m] << " ms"; });
+}
+
+/*!
+\brief Compare the relaxed atomic accesses of the fields with plain accesses, at random cells as in the grain transport.
+Reports millions of accesses per second.
+*/
+void BenchmarkFieldAccess(const DuneSediment& terrain)
+{
+	const int passes = 10;
+	const int nx = terrain.SedimentField().SizeX();
+	const int ny = terrain.SedimentField().SizeY();
+	std::vector<int> cells(nx * ny);
+	for (int k = 0; k < nx * ny; k++)
+		cells[k] = terrain.ToIndex1D(Random::Integer(nx), Random::Integer(ny));
+
+	ScalarField2D field = terrain.SedimentField();
+	float* data = field.Data();
+	const int n = int(cells.size());
+	float sum[2] = { 0.0f, 0.0f };
+	double t[4];
+	t[0] = Timing([&]()
+	{
+		for (int pass = 0; pass < passes; pass++)
+			for (int k = 0; k < n; k++)
+				sum[0] += data[cells[k]];
+	});
+	t[1] = Timing([&]()
+	{
+		for (int pass = 0; pass < passes; pass++)
+			for (int k = 0; k < n; k++)
+				sum[1] += field.Get(cells[k]);
+	});
+	t[2] = Timing([&]()
+	{
+		for (int pass = 0; pass < passes; pass++)
+		{
+			for (int k = 0; k < n; k++)
+			{
+#pragma omp atomic
+				data[cells[k]] += 1e-6f;
+			}
+		}
+	});
+	t[3] = Timing([&]()
+	{
+		for (int pass = 0; pass < passes; pass++)
+			for (int k = 0; k < n; k++)
+				field.FetchAdd(cells[k], 1e-6f);
+	});
+	const double m = double(passes) * n / 1e6;
+	std::cout << "Field loads: plain " << m / t[0] << " M/s, relaxed " << m / t[1] << " M/s (" << (sum[0] == sum[1] ? "same" : "different") << " sums)" << std::endl;
+	std::cout << "Field additions: omp atomic " << m / t[2] << " M/s, relaxed fetch_add " << m / t[3] << " M/s" << std::endl;
+}
+
+/*!
+\brief Compare the throughput of the terrain elevation sampling at random world points: two separate
+bilinear interpolations, the fused sampler and the batched sampler, and report the largest difference between their values.
+*/
+void BenchmarkHeightSampler(const DuneSediment& terrain)
+{
+	const ScalarField2D& bedrock = terrain.BedrockField();
+	const ScalarField2D& sediments = terrain.SedimentField();
+	const int n = 1 << 22;
+	const Vector2 a = bedrock.GetBox().Vertex(0);
+	const Vector2 d = bedrock.GetBox().Vertex(1) - a;
+	std::vector<float> x(n), y(n), h[3];
+	for (int k = 0; k < n; k++)
+	{
+		x[k] = a[0] + d[0] * Random::Uniform();
+		y[k] = a[1] + d[1] * Random::Uniform();
+	}
+	for (int m = 0; m < 3; m++)
+		h[m].resize(n);
+
+	double t[3];
+	t[0] = Timing([&]()
+	{
+		for (int k = 0; k < n; k++)
+		{
+			const Vector2 p(x[k], y[k]);
+			h[0][k] = bedrock.GetValueBilinear(p) + sediments.GetValueBilinear(p);
+		}
+	});
+	t[1] = Timing([&]()
+	{
+		for (int k = 0; k < n; k++)
+			h[1][k] = ScalarField2D::GetValueBilinearSum(bedrock, sediments, Vector2(x[k], y[k]));
+	});
+	t[2] = Timing([&]()
+	{
+		for (int k = 0; k < n; k += 8)
+			ScalarField2D::GetValueBilinearSum8(bedrock, sediments, &x[k], &y[k], &h[2][k]);
+	});
+	float e = 0.0f;
+	for (int k = 0; k < n; k++)
+		e = Math::Max(e, Math::Max(std::abs(h[1][k] - h[0][k]), std::abs(h[2][k] - h[0][k])));
+
+	const double m = double(n) / 1e6;
+	std::cout << "Height sampler: separate " << m / t[0] << " M/s, fused " << m / t[1] << " M/s, batched " << m / t[2] << " M/s (max difference " << e << ")" << std::endl;
+}
+
+/*!
+\brief Compare the time per simulation step of the per-grain and relaxation avalanche modes,
+starting from a terrain.
+\param steps number of simulation steps per mode
+*/
+void BenchmarkAvalanches(const DuneSediment& terrain, int steps)
+{
+	const AvalancheMode modes[2] = { AvalancheMode::PerGrain, AvalancheMode::Relaxation };
+	const char* names[2] = { "per grain", "relaxation" };
+	CompareModes(terrain, "Avalanches", names, 2, steps, [&](DuneSediment& dune, int m) { dune.SetAvalancheMode(modes[m]); });
+}
+
+/*!
+\brief Compare the load balance of the OpenMP and work stealing executions, starting from a terrain.
+Reports the time per step and the busy time of each thread, gathered at the end of every step.
+\param steps number of simulation steps per mode
+*/
+void BenchmarkExecution(const DuneSediment& terrain, int steps)
+{
+	const ExecutionMode modes[2] = { ExecutionMode::OpenMP, ExecutionMode::WorkStealing };
+	const char* names[2] = { "OpenMP", "work stealing" };
+	std::vector<double> busy;
+	CompareModes(terrain, "Execution", names, 2, steps,
+		[&](DuneSediment& dune, int m)
+		{
+			dune.SetExecutionMode(modes[m]);
+			busy.clear();
+			dune.AddPeriodicTask("busy times", 1, 1, [&busy](DuneSediment& simulation, int, int)
+			{
+				const std::vector<double>& b = simulation.ThreadBusyTimes();
+				busy.resize(b.size(), 0.0);
+				for (int k = 0; k < int(b.size()); k++)
+					busy[k] += b[k];
+			});
+		},
+		[&](const DuneSediment&, int)
+		{
+			// Imbalance: busiest thread compared to the average
+			double sum = 0.0, max = 0.0;
+			std::cout << ", busy ms/step per thread:";
+			for (int k = 0; k < int(busy.size()); k++)
+			{
+				std::cout << " " << 1000.0 * busy[k] / steps;
+				sum += busy[k];
+				max = Math::Max(max, busy[k]);
+			}
+			std::cout << ", imbalance " << (sum > 0.0 ? max * busy.size() / sum : 0.0);
+		});
+}
+
+/*!
+\brief Compare the full and incremental bedrock stabilizations after a few simulation steps with abrasion.
+\param steps number of simulation steps performed with abrasion before the stabilization
+*/
+void BenchmarkBedrockStabilization(const DuneSediment& terrain, int steps)
+{
+	DuneSediment dune = terrain;
+	dune.SetAbrasionMode(true);
+	dune.SetTaskPeriod(BedrockStabilizationTask, 0);
+	for (int i = 0; i < steps; i++)
+		dune.SimulationStepMultiThreadAtomic();
+
+	DuneSediment full = dune;
+	DuneSediment incremental = dune;
+	double tFull = Timing([&]() { full.StabilizeBedrockAll(); });
+	double tIncremental = Timing([&]() { incremental.StabilizeBedrockSlice(0, 1); });
+	std::cout << "Bedrock stabilization (" << dune.AbradedCells() << " abraded cells): full " << 1000.0 * tFull << " ms, incremental " << 1000.0 * tIncremental << " ms" << std::endl;
+}
+
+/*!
+\brief Compare the time per simulation step of the grain budgets on a low supply version of a terrain,
+where only one row out of four keeps its sediments.
+\param steps number of simulation steps per budget
+*/
+void BenchmarkGrainBudget(const DuneSediment& terrain, int steps)
+{
+	DuneSediment sparse = terrain;
+	const Box2D box = terrain.SedimentField().GetBox();
+	const int n = terrain.SedimentField().SizeX();
+	sparse.Edit("sparse rows", box, [&box, n](const Vector2& p, float&, float& sand, float&)
+	{
+		// Row of the cell, see ScalarField2D::ArrayVertex()
+		const int i = int(std::lround((p[1] - box[0][1]) / (box[1][1] - box[0][1]) * (n - 1)));
+		if (i % 4 != 0)
+			sand = 0.0f;
+	});
+	sparse.ClearHistory();
+
+	const GrainBudgetMode modes[3] = { GrainBudgetMode::Grid, GrainBudgetMode::PerActiveCell, GrainBudgetMode::MobileMass };
+	const char* names[3] = { "grid", "per active cell", "mobile mass" };
+	long long grains = 0;
+	CompareModes(sparse, "Grain budget", names, 3, steps,
+		[&](DuneSediment& dune, int m)
+		{
+			dune.SetGrainBudget(modes[m], 1.0f);
+			grains = 0;
+			dune.AddPeriodicTask("grain count", 1, 1, [&grains](DuneSediment& simulation, int, int) { grains += simulation.GrainCount(); });
+		},
+		[&](const DuneSediment&, int) { std::cout << ", " << grains / steps << " grains/step"; });
+}
+
+/*!
+\brief Compare the unsorted and tiled lift orders, starting from a terrain. Reports the time per step,
+the cache and TLB misses of the OpenMP threads when hardware counters are available, and the sediment statistics
+after the last step, which should not depend on the order.
+\param steps number of simulation steps per order
+*/
+void BenchmarkLiftOrder(const DuneSediment& terrain, int steps)
+{
+	const LiftOrder orders[2] = { LiftOrder::Unsorted, LiftOrder::Tiled };
+	const char* names[2] = { "unsorted", "tiled" };
+
+	// Counters are per thread, and the threads of the OpenMP pool are reused from one parallel region to the next
+	std::vector<MissCounters> counters(OMP_NUM_THREAD);
+	CompareModes(terrain, "Lift order", names, 2, steps,
+		[&](DuneSediment& dune, int m)
+		{
+			dune.SetExecutionMode(ExecutionMode::OpenMP);
+			dune.SetLiftOrder(orders[m]);
+#pragma omp parallel num_threads(OMP_NUM_THREAD)
+			counters[omp_get_thread_num()].Open();
+		},
+		[&](const DuneSediment& dune, int)
+		{
+			int available = 0;
+#pragma omp parallel num_threads(OMP_NUM_THREAD) reduction(+:available)
+			available += counters[omp_get_thread_num()].Close() ? 1 : 0;
+			long long misses[2] = { 0, 0 };
+			for (int k = 0; k < OMP_NUM_THREAD; k++)
+			{
+				misses[0] += counters[k].misses[0];
+				misses[1] += counters[k].misses[1];
+			}
+			std::cout << ", max height " << dune.Statistics().maxHeight;
+			if (available > 0)
+				std::cout << ", " << misses[0] / steps << " cache misses/step, " << misses[1] / steps << " TLB misses/step";
+			else
+				std::cout << ", hardware counters unavailable";
+		});
+}
+
+/*!
+\brief Compare the lift site samplings, starting from a terrain. For each sampling, reports the coverage
+of one step (cells never drawn, most draws of a cell), then the root mean square height change of each step: the
+terrain converges to stable forms when it drops below the tolerance, and the number of grains needed is reported.
+\param steps maximum number of simulation steps per sampling
+\param tolerance root mean square height change per step under which the terrain is considered converged, in meter
+*/
+void BenchmarkLiftSampling(const DuneSediment& terrain, int steps, float tolerance)
+{
+	const LiftSampling samplings[4] = { LiftSampling::Random, LiftSampling::Stratified, LiftSampling::LowDiscrepancy, LiftSampling::Permutation };
+	const char* names[4] = { "random", "stratified", "low discrepancy", "permutation" };
+	const int nx = terrain.SedimentField().SizeX();
+	const int ny = terrain.SedimentField().SizeY();
+	for (int m = 0; m < 4; m++)
+	{
+		DuneSediment dune = terrain;
+		dune.SetLiftSampling(samplings[m]);
+
+		// Coverage of the lift sites of one step
+		const std::vector<Vector2i> sites = dune.DrawLiftSites();
+		std::vector<int> draws(nx * ny, 0);
+		for (int k = 0; k < int(sites.size()); k++)
+			draws[sites[k].x * ny + sites[k].y]++;
+		int unsampled = 0, maxDraws = 0;
+		for (int k = 0; k < nx * ny; k++)
+		{
+			unsampled += draws[k] == 0 ? 1 : 0;
+			maxDraws = Math::Max(maxDraws, draws[k]);
+		}
+		std::cout << "Lift sampling (" << names[m] << "): " << 100.0 * unsampled / (nx * ny) << "% cells never drawn, at most " << maxDraws << " draws per cell" << std::endl;
+
+		// Convergence
+		std::vector<float> previous(nx * ny);
+		for (int i = 0; i < nx; i++)
+			for (int j = 0; j < ny; j++)
+				previous[i * ny + j] = dune.Height(i, j);
+		long long total = 0;
+		long long converged = -1;
+		std::cout << "  rms height change per step:";
+		for (int s = 0; s < steps && converged < 0; s++)
+		{
+			dune.SimulationStepMultiThreadAtomic();
+			total += dune.GrainCount();
+			double sum = 0.0;
+			for (int i = 0; i < nx; i++)
+			{
+				for (int j = 0; j < ny; j++)
+				{
+					const float h = dune.Height(i, j);
+					sum += (h - previous[i * ny + j]) * (h - previous[i * ny + j]);
+					previous[i * ny + j] = h;
+				}
+			}
+			const double rms = sqrt(sum / (nx * ny));
+			std::cout << " " << rms;
+			if (rms < tolerance)
+				converged = total;
+		}
+		std::cout << std::endl;
+		if (converged < 0)
+			std::cout << "  not converged after " << total << " grains" << std::endl;
+		else
+			std::cout << "  converged after " << converged << " grains" << std::endl;
+	}
+}
+
+/*!
+\brief Fork three branches from a snapshot of a terrain with different winds, and report the cost
+of the snapshots and forks, and the memory of the branch snapshots that is not shared with the fork point.
+\param steps number of simulation steps per branch
+*/
+void BenchmarkSnapshots(const DuneSediment& terrain, int steps)
+{
+	const int nx = terrain.SedimentField().SizeX();
+	const int ny = terrain.SedimentField().SizeY();
+	DuneSnapshot origin;
+	const double ts = Timing([&]() { origin = terrain.Snapshot(); });
+
+	const int forks = 1000;
+	std::vector<DuneSnapshot> copies(forks);
+	const double tf = Timing([&]()
+	{
+		for (int k = 0; k < forks; k++)
+			copies[k] = origin;
+	});
+	copies.clear();
+	std::cout << "Snapshots: capture " << 1000.0 * ts << " ms, fork " << 1e6 * tf / forks << " us, "
+		<< origin.Memory() / (1024 * 1024) << " MB, " << origin.bedrock.Tiles() << " tiles per layer" << std::endl;
+
+	const Vector2 w = terrain.Wind();
+	const float angles[3] = { -20.0f, 0.0f, 20.0f };
+	for (int b = 0; b < 3; b++)
+	{
+		DuneSediment branch = terrain;
+		const double tr = Timing([&]() { branch.Restore(origin); });
+		bool exact = true;
+		for (int i = 0; i < nx && exact; i++)
+			for (int j = 0; j < ny && exact; j++)
+				exact = branch.Height(i, j) == terrain.Height(i, j);
+
+		const float a = ToRadians(angles[b]);
+		branch.SetWind(Vector2(cos(a) * w.x - sin(a) * w.y, sin(a) * w.x + cos(a) * w.y));
+		for (int s = 0; s < steps; s++)
+			branch.SimulationStepMultiThreadAtomic();
+
+		DuneSnapshot end;
+		const double te = Timing([&]() { end = branch.Snapshot(&origin); });
+		std::cout << "Branch (wind " << angles[b] << " degrees): restore " << 1000.0 * tr << " ms (" << (exact ? "exact" : "different")
+			<< "), snapshot " << 1000.0 * te << " ms, " << end.Memory(&origin) / 1024 << " KB not shared out of " << end.Memory() / 1024 << " KB, shared tiles: bedrock "
+			<< end.bedrock.SharedTiles(origin.bedrock) << ", sediments " << end.sediments.SharedTiles(origin.sediments) << ", vegetation " << end.vegetation.SharedTiles(origin.vegetation) << std::endl;
+	}
+}
+
+/*!
+\brief Apply random sand and bedrock brushes to a terrain, then undo and redo all of them. Reports the time
+per edit, undo and redo, the memory of the history compared to full copies of the three layers, and checks that
+undoing all the edits restores the terrain exactly. Then caps the history and reports the evicted edits.
+\param edits number of edits
+*/
+void BenchmarkEditHistory(const DuneSediment& terrain, int edits)
+{
+	const int nx = terrain.SedimentField().SizeX();
+	const int ny = terrain.SedimentField().SizeY();
+	DuneSediment dune = terrain;
+	dune.ClearHistory();
+	dune.SetHistoryCapacity(size_t(1) << 30);
+	const Box2D box = terrain.SedimentField().GetBox();
+	const Vector2 a = box.BottomLeft();
+	const Vector2 size = box.Size();
+	std::vector<Vector2> centers(edits);
+	for (int k = 0; k < edits; k++)
+		centers[k] = a + Vector2(size.x * Random::Uniform(), size.y * Random::Uniform());
+
+	const double te = Timing([&]()
+	{
+		for (int k = 0; k < edits; k++)
+		{
+			if (k % 2 == 0)
+				dune.AddSediments(centers[k], 20.0f, 2.0f);
+			else
+				dune.AddBedrock(centers[k], 20.0f, -1.0f);
+		}
+	});
+	const size_t memory = dune.HistoryMemory();
+	const double tu = Timing([&]() { while (dune.Undo()); });
+	bool exact = true;
+	for (int i = 0; i < nx && exact; i++)
+		for (int j = 0; j < ny && exact; j++)
+			exact = dune.Height(i, j) == terrain.Height(i, j);
+	const double tr = Timing([&]() { while (dune.Redo()); });
+	const size_t copies = size_t(edits) * 3 * sizeof(float) * nx * ny;
+	std::cout << "Edit history: edit " << 1000.0 * te / edits << " ms, undo " << 1000.0 * tu / edits << " ms, redo " << 1000.0 * tr / edits
+		<< " ms, " << memory / edits / 1024 << " KB per edit instead of " << copies / edits / 1024 << " KB, undo " << (exact ? "exact" : "different") << std::endl;
+
+	// Cap at a quarter of the history
+	dune.SetHistoryCapacity(memory / 4);
+	int undone = 0;
+	while (dune.Undo())
+		undone++;
+	std::cout << "  capped at " << memory / 4 / 1024 << " KB: " << edits - dune.HistorySize() << " oldest edits evicted, " << undone << " left to undo" << std::endl;
+}
+
+/*!
+\brief Compare the time per simulation step with and without sleeping tiles, starting from a terrain,
+and report the number of sleeping tiles along the steps.
+\param steps number of simulation steps per mode
+*/
+void BenchmarkSleepingTiles(const DuneSediment& terrain, int steps)
+{
+	const char* names[2] = { "off", "on" };
+	std::vector<int> sleeping;
+	CompareModes(terrain, "Sleeping tiles", names, 2, steps,
+		[&](DuneSediment& dune, int m)
+		{
+			dune.SetSleepingTiles(m == 1);
+			sleeping.clear();
+			dune.AddPeriodicTask("sleeping tiles", 1, 1, [&sleeping](DuneSediment& simulation, int, int) { sleeping.push_back(simulation.SleepingTiles()); });
+		},
+		[&](const DuneSediment& dune, int m)
+		{
+			if (m == 0)
+				return;
+			std::cout << ", sleeping tiles per step out of " << dune.SleepTileCount() << ":";
+			for (int i = 0; i < int(sleeping.size()); i++)
+				std::cout << " " << sleeping[i];
+		});
+}
+
+/*!
+\brief Compare the grain and flux transport engines, starting from a terrain: time per simulation step,
+sediment budget, reproducibility of two runs, and mean difference of the sediment layer with a run of the grains.
+\param steps number of simulation steps per engine
+*/
+void BenchmarkTransportEngine(const DuneSediment& terrain, int steps)
+{
+	const TransportEngine engines[2] = { TransportEngine::Grains, TransportEngine::Flux };
+	const char* names[2] = { "grains", "flux" };
+	const int nx = terrain.SedimentField().SizeX();
+	const int ny = terrain.SedimentField().SizeY();
+	DuneSediment reference = terrain;
+	for (int i = 0; i < steps; i++)
+		reference.SimulationStepMultiThreadAtomic();
+	for (int m = 0; m < 2; m++)
+	{
+		DuneSediment runs[2] = { terrain, terrain };
+		double t = 0.0;
+		for (int r = 0; r < 2; r++)
+		{
+			runs[r].SetTransportEngine(engines[m]);
+			t += Timing([&]()
+			{
+				for (int i = 0; i < steps; i++)
+					runs[r].SimulationStepMultiThreadAtomic();
+			});
+		}
+		bool reproducible = true;
+		double difference = 0.0;
+		for (int i = 0; i < nx; i++)
+		{
+			for (int j = 0; j < ny; j++)
+			{
+				reproducible = reproducible && runs[0].Sediment(i, j) == runs[1].Sediment(i, j);
+				difference += std::abs(runs[0].Sediment(i, j) - reference.Sediment(i, j));
+			}
+		}
+		runs[0].GatherStatistics(0, 1);
+		std::cout << "Transport engine (" << names[m] << "): " << 1000.0 * t / (2 * steps) << " ms/step, sediments " << runs[0].Statistics().sediments
+			<< ", runs " << (reproducible ? "identical" : "different") << ", mean difference to grains " << difference / (nx * ny) << " m" << std::endl;
+	}
+}
+
+/*!
+\brief Measure the cost of the turbulent wind: evaluation of the field alone, and simulation steps without and with
+turbulence, starting from a terrain.
+\param steps number of simulation steps per mode
+*/
+void BenchmarkTurbulence(const DuneSediment& terrain, int steps)
+{
+	const float base = Magnitude(terrain.Wind());
+	const char* names[2] = { "off", "on" };
+	double field[2];
+	CompareModes(terrain, "Turbulence", names, 2, steps,
+		[&](DuneSediment& dune, int m)
+		{
+			dune.SetTurbulence(m == 1 ? 0.5f * base : 0.0f);
+			field[m] = Timing([&]()
+			{
+				for (int i = 0; i < steps; i++)
+					dune.UpdateTurbulence();
+			});
+		},
+		[&](const DuneSediment& dune, int m)
+		{
+			if (m == 0)
+				return;
+			const int nx = dune.SedimentField().SizeX();
+			const int ny = dune.SedimentField().SizeY();
+			double speed = 0.0;
+			for (int i = 0; i < nx; i++)
+				for (int j = 0; j < ny; j++)
+					speed += Magnitude(dune.TurbulentWind(i, j));
+			std::cout << ", field " << 1000.0 * field[m] / steps << " ms/step, mean turbulent wind " << speed / (nx * ny) << " for a base wind of " << base;
+		});
+}
+
+/*!
+\brief Compare the local speed-up of the wind with the coarse wind solver, starting from a terrain:
+cost of one solution, time per simulation step with the solution amortized, and spread of the wind speed over the cells.
+\param steps number of simulation steps per mode
+*/
+void BenchmarkWindSolver(const DuneSediment& terrain, int steps)
+{
+	const float base = Magnitude(terrain.Wind());
+	const char* names[2] = { "local", "solver" };
+	double solve = 0.0;
+	float low = 1e10f;
+	float high = 0.0f;
+	CompareModes(terrain, "Wind", names, 2, steps,
+		[&](DuneSediment& dune, int m)
+		{
+			if (m == 1)
+				solve = Timing([&]() { dune.SetWindSolver(true); });
+
+			// Wind speed relative to the base wind, before the deflection by the slopes
+			const ScalarField2D& sand = dune.SedimentField();
+			low = 1e10f;
+			high = 0.0f;
+			for (int i = 0; i < sand.SizeX(); i++)
+			{
+				for (int j = 0; j < sand.SizeY(); j++)
+				{
+					const float speed = m == 1 ? Magnitude(dune.SolvedWind(i, j)) : (1.0f + 0.005f * sand.Get(i, j)) * base;
+					low = Math::Min(low, speed / base);
+					high = Math::Max(high, speed / base);
+				}
+			}
+		},
+		[&](const DuneSediment& dune, int m)
+		{
+			std::cout << ", wind speed from " << low << " to " << high << " times the base wind";
+			if (m == 1)
+				std::cout << ", solution " << 1000.0 * solve << " ms every " << dune.TaskPeriod(WindSolverTask) << " steps";
+		});
+}
+
+/*!
+\brief Compare the uniform repose angles with per-cell repose fields, starting from a terrain: time per
+simulation step with the uniform fast path, with a field holding the same angle everywhere, and with wet patches of steeper sand.
+\param steps number of simulation steps per mode
+*/
+void BenchmarkRepose(const DuneSediment& terrain, int steps)
+{
+	const float uniform = atanf(terrain.SedimentReposeTangent()) * 180.0f / M_PI;
+	const ScalarField2D& sand = terrain.SedimentField();
+	const char* names[3] = { "uniform", "field", "wet patches" };
+	CompareModes(terrain, "Repose", names, 3, steps, [&](DuneSediment& dune, int m)
+	{
+		if (m == 0)
+			return;
+		ScalarField2D degrees(sand.SizeX(), sand.SizeY(), sand.GetBox(), uniform);
+		if (m == 2)
+		{
+			for (int i = 0; i < sand.SizeX(); i++)
+			{
+				for (int j = 0; j < sand.SizeY(); j++)
+				{
+					const float wet = PerlinNoise::GetValue(Vector2(float(i), float(j)) / 48.0f) * 0.5f + 0.5f;
+					degrees.Set(i, j, Math::Lerp(uniform, 45.0f, Math::Clamp(2.0f * wet - 0.5f)));
+				}
+			}
+		}
+		dune.SetSedimentRepose(degrees);
+	});
+}
+
+/*!
+\brief Compare a single sand class with two and four grain size classes, starting from a terrain: time per
+simulation step, memory of the packed fractions, and share of the coarsest class in the active layer of the sandy
+cells after the steps: its spread grows as the grains are sorted.
+\param steps number of simulation steps per mode
+*/
+void BenchmarkSedimentClasses(const DuneSediment& terrain, int steps)
+{
+	const std::vector<SedimentClass> two = { { 0.5f, 1.2f, 1.3f, 32.0f }, { 0.5f, 0.6f, 0.6f, 35.0f } };
+	const std::vector<SedimentClass> four = { { 0.25f, 1.4f, 1.5f, 31.0f }, { 0.25f, 1.1f, 1.2f, 32.0f },
+		{ 0.25f, 0.8f, 0.9f, 34.0f }, { 0.25f, 0.5f, 0.6f, 36.0f } };
+	const std::vector<SedimentClass>* classes[3] = { nullptr, &two, &four };
+	const char* names[3] = { "1", "2", "4" };
+	CompareModes(terrain, "Sediment classes", names, 3, steps,
+		[&](DuneSediment& dune, int m)
+		{
+			if (classes[m] != nullptr)
+				dune.SetSedimentClasses(*classes[m]);
+		},
+		[&](const DuneSediment& dune, int m)
+		{
+			if (classes[m] == nullptr)
+				return;
+			const int n = int(classes[m]->size());
+			const int nx = dune.SedimentField().SizeX();
+			const int ny = dune.SedimentField().SizeY();
+			double coarse = 0.0;
+			float low = 1.0f;
+			float high = 0.0f;
+			int sandy = 0;
+			for (int i = 0; i < nx; i++)
+			{
+				for (int j = 0; j < ny; j++)
+				{
+					if (dune.Sediment(i, j) <= 0.0f)
+						continue;
+					const float f = dune.SedimentFraction(i, j, n - 1);
+					coarse += f;
+					low = Math::Min(low, f);
+					high = Math::Max(high, f);
+					sandy++;
+				}
+			}
+
+			// One packed cell of four halves per cell
+			const size_t fractions = sizeof(Half4) * nx * ny;
+			std::cout << ", fractions " << fractions / (1 << 20) << " MB, coarsest class " << coarse / Math::Max(sandy, 1)
+				<< " of the active layer from " << low << " to " << high << ", initially " << classes[m]->back().fraction;
+		});
+}
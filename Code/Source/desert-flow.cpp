@@ -2,6 +2,13 @@
 
 #include <algorithm>
 #include <omp.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// File scope variables
+#define OMP_NUM_THREAD 8
+#define CASCADE_SPLIT_SIZE 64
 
 static Vector2i next8[8] = { Vector2i(1, 0), Vector2i(1, 1), Vector2i(0, 1), Vector2i(-1, 1), Vector2i(-1, 0), Vector2i(-1, -1), Vector2i(0, -1), Vector2i(1, -1) };
 static float length8[8] = { 1.0f, sqrtf(2.0f), 1.0, sqrtf(2.0f), 1.0f, sqrtf(2.0f), 1.0f, sqrt(2.0f) };
@@ -11,27 +18,24 @@ static Vector2i Next(int i, int j, int k)
 }
 
 /*!
-\brief Compute the flow directions at a given point. Returns an integer representing the number of neighbour to distribute
-the material to. Arrays nei and nslope contains respectively the neighbours in grid coordinates and the unit slopes.
-\param p Point.
-\param tanThresholdAngle tangent of the repose angle.
-\param nei returned neighbour array.
-\param nslope returned unit slope array.
+\brief Compute the directions, among the 8 neighbours, in which the material flows.
+Heights are the sum of one or two layers, read at constant offsets from the center cell.
+Returns the number of flow directions; arrays dir and nslope contain the direction indices
+and the normalized slopes.
 */
-int DuneSediment::CheckSedimentFlowRelative(const Vector2i& p, float tanThresholdAngle, Vector2i* nei, float* nslope) const
+template<bool TwoLayers>
+static inline int FlowDirections(const float* a, const float* b, int id, const int* offset8, float cellSize, float tanThresholdAngle, int* dir, float* nslope)
 {
-	const float zp = Height(p.x, p.y);
+	const float zp = TwoLayers ? Atomic::Load(a[id]) + Atomic::Load(b[id]) : Atomic::Load(a[id]);
 	int n = 0;
 	float slopesum = 0.0;
 	for (int i = 0; i < 8; i++)
 	{
-		Vector2i b = Next(p.x, p.y, i);
-		if (b.x < 0 || b.x >= nx || b.y < 0 || b.y >= ny)
-			continue;
-		float step = zp - Height(b.x, b.y);
+		const int nid = id + offset8[i];
+		float step = zp - (TwoLayers ? Atomic::Load(a[nid]) + Atomic::Load(b[nid]) : Atomic::Load(a[nid]));
 		if (step > 0.0 && (step / cellSize * length8[i]) > tanThresholdAngle)
 		{
-			nei[n] = b;
+			dir[n] = i;
 			nslope[n] = step / length8[i];
 			slopesum += nslope[n];
 			n++;
@@ -42,6 +46,108 @@ int DuneSediment::CheckSedimentFlowRelative(const Vector2i& p, float tanThreshol
 	return n;
 }
 
+#if defined(__AVX2__)
+/*!
+\brief Table used to compact the lanes selected by a 8-bit mask at the beginning of a register.
+Entry m lists the indices of the bits set in m, which are also the flow direction indices.
+*/
+struct CompactTable8
+{
+	alignas(32) int lanes[256][8];
+
+	CompactTable8()
+	{
+		for (int m = 0; m < 256; m++)
+		{
+			int n = 0;
+			for (int k = 0; k < 8; k++)
+			{
+				if (m & (1 << k))
+					lanes[m][n++] = k;
+			}
+			for (; n < 8; n++)
+				lanes[m][n] = 0;
+		}
+	}
+};
+static const CompactTable8 compact8;
+
+/*!
+\brief Vectorized version of FlowDirections(), processing the 8 neighbours in a single register.
+Computes the exact same operations in the same order, hence returns identical results.
+Gathers are plain loads, not the relaxed atomic loads of the scalar version. The cascades of the grain transport
+call this kernel on cells other threads are adding sand to, which the C++ memory model counts as a data race even
+though each aligned lane is read by a single access on x86 and sees either the old or the new height, like a relaxed
+load. The race-free guarantee of Atomic only holds without AVX2: data race detectors must be run on such a build.
+*/
+template<bool TwoLayers>
+static inline int FlowDirectionsAVX2(const float* a, const float* b, int id, const int* offset8, float cellSize, float tanThresholdAngle, int* dir, float* nslope)
+{
+	const __m256i offsets = _mm256_loadu_si256((const __m256i*)offset8);
+	const __m256 lengths = _mm256_loadu_ps(length8);
+	const float zp = TwoLayers ? Atomic::Load(a[id]) + Atomic::Load(b[id]) : Atomic::Load(a[id]);
+
+	// Gather the 3x3 neighbourhood and compute all slopes at once, plain loads racing with concurrent cascades
+	__m256 h = _mm256_i32gather_ps(a + id, offsets, 4);
+	if (TwoLayers)
+		h = _mm256_add_ps(h, _mm256_i32gather_ps(b + id, offsets, 4));
+	const __m256 step = _mm256_sub_ps(_mm256_set1_ps(zp), h);
+	const __m256 slope = _mm256_mul_ps(_mm256_div_ps(step, _mm256_set1_ps(cellSize)), lengths);
+	const __m256 flow = _mm256_and_ps(_mm256_cmp_ps(step, _mm256_setzero_ps(), _CMP_GT_OQ), _mm256_cmp_ps(slope, _mm256_set1_ps(tanThresholdAngle), _CMP_GT_OQ));
+	const int mask = _mm256_movemask_ps(flow);
+	if (mask == 0)
+		return 0;
+
+	// Compact the flowing neighbours at the beginning of the output arrays
+	const __m256i lanes = _mm256_load_si256((const __m256i*)compact8.lanes[mask]);
+	_mm256_storeu_si256((__m256i*)dir, lanes);
+	_mm256_storeu_ps(nslope, _mm256_permutevar8x32_ps(_mm256_div_ps(step, lengths), lanes));
+
+	// Sequential sum to keep the rounding of the scalar version
+	const int n = _mm_popcnt_u32(mask);
+	float slopesum = 0.0;
+	for (int k = 0; k < n; k++)
+		slopesum += nslope[k];
+	for (int k = 0; k < n; k++)
+		nslope[k] = nslope[k] / slopesum;
+	return n;
+}
+#endif
+
+/*!
+\brief Compute the flow directions at a given point. Returns an integer representing the number of neighbour to distribute
+the material to. Arrays nei and nslope contains respectively the neighbours in grid coordinates and the unit slopes.
+Vectorized when AVX2 is available.
+\param p Point.
+\param tanThresholdAngle tangent of the repose angle.
+\param nei returned neighbour array.
+\param nslope returned unit slope array.
+*/
+int DuneSediment::CheckSedimentFlowRelative(const Vector2i& p, float tanThresholdAngle, Vector2i* nei, float* nslope) const
+{
+	int dir[8];
+#if defined(__AVX2__)
+	int n = FlowDirectionsAVX2<true>(bedrock.Data(), sediments.Data(), ToIndex1D(p), offset8, cellSize, tanThresholdAngle, dir, nslope);
+#else
+	int n = FlowDirections<true>(bedrock.Data(), sediments.Data(), ToIndex1D(p), offset8, cellSize, tanThresholdAngle, dir, nslope);
+#endif
+	for (int k = 0; k < n; k++)
+		nei[k] = SnapGrid(Next(p.x, p.y, dir[k]));
+	return n;
+}
+
+/*!
+\brief Scalar reference implementation of CheckSedimentFlowRelative().
+*/
+int DuneSediment::CheckSedimentFlowRelativeScalar(const Vector2i& p, float tanThresholdAngle, Vector2i* nei, float* nslope) const
+{
+	int dir[8];
+	int n = FlowDirections<true>(bedrock.Data(), sediments.Data(), ToIndex1D(p), offset8, cellSize, tanThresholdAngle, dir, nslope);
+	for (int k = 0; k < n; k++)
+		nei[k] = SnapGrid(Next(p.x, p.y, dir[k]));
+	return n;
+}
+
 /*!
 \brief Compute the flow directions at a given point. Returns an integer representing the number of neighbour to distribute
 the material to. Arrays nei and nslope contains respectively the neighbours in grid coordinates and the unit slopes.
@@ -52,43 +158,68 @@ the material to. Arrays nei and nslope contains respectively the neighbours in g
 */
 int DuneSediment::CheckBedrockFlowRelative(const Vector2i& p, float tanThresholdAngle, Vector2i* nei, float* nslope) const
 {
-	const float zp = Bedrock(p.x, p.y);
-	int n = 0;
-	float slopesum = 0.0;
-	for (int i = 0; i < 8; i++)
-	{
-		Vector2i b = Next(p.x, p.y, i);
-		if (b.x < 0 || b.x >= nx || b.y < 0 || b.y >= ny)
-			continue;
-		float step = zp - Bedrock(b.x, b.y);
-		if (step > 0.0 && (step / cellSize * length8[i]) > tanThresholdAngle)
-		{
-			nei[n] = b;
-			nslope[n] = step / length8[i];
-			slopesum += nslope[n];
-			n++;
-		}
-	}
+	int dir[8];
+#if defined(__AVX2__)
+	int n = FlowDirectionsAVX2<false>(bedrock.Data(), nullptr, ToIndex1D(p), offset8, cellSize, tanThresholdAngle, dir, nslope);
+#else
+	int n = FlowDirections<false>(bedrock.Data(), nullptr, ToIndex1D(p), offset8, cellSize, tanThresholdAngle, dir, nslope);
+#endif
 	for (int k = 0; k < n; k++)
-		nslope[k] = nslope[k] / slopesum;
+		nei[k] = SnapGrid(Next(p.x, p.y, dir[k]));
 	return n;
 }
 
 /*!
-\brief Stabilize a given grid vertex with the use of CheckSedimentFlowRelative() function.
-Used by multi-thread functions, but can also be used in a single-thread context.
+\brief Stabilize a given grid vertex with the use of CheckSedimentFlowRelative() function, with the sediment classes
+of the simulation. Used by multi-thread functions, but can also be used in a single-thread context.
 \param i x coordinate
 \param j y coordinate
 */
 void DuneSediment::StabilizeSedimentRelative(int i, int j)
+{
+	if (sedimentClasses.empty())
+		StabilizeSedimentRelative<false>(i, j);
+	else
+		StabilizeSedimentRelative<true>(i, j);
+}
+
+/*!
+\brief Stabilize a given grid vertex, the cascades of the transport kernels.
+\param i x coordinate
+\param j y coordinate
+*/
+template<bool Classes>
+void DuneSediment::StabilizeSedimentRelative(int i, int j)
 {
 	std::vector<Vector2i> queueToStabilize;
+	queueToStabilize.push_back(Vector2i(i, j));
+	StabilizeSedimentQueue<Classes>(queueToStabilize);
+}
+
+template void DuneSediment::StabilizeSedimentRelative<false>(int i, int j);
+template void DuneSediment::StabilizeSedimentRelative<true>(int i, int j);
+
+/*!
+\brief Stabilize a list of grid vertices, and the neighbours they distribute sand to, until the queue is empty.
+With the work stealing execution, long cascades are split: half of the queue becomes a new task that idle threads can steal.
+\param queueToStabilize grid vertices to stabilize.
+*/
+template<bool Classes>
+void DuneSediment::StabilizeSedimentQueue(std::vector<Vector2i>& queueToStabilize)
+{
+	const bool split = execution == ExecutionMode::WorkStealing && TaskScheduler::CurrentWorker() >= 0;
 	Vector2i pts[8];
 	float s[8];
 	int n = 0;
-	queueToStabilize.push_back(Vector2i(i, j));
 	while (queueToStabilize.empty() == false)
 	{
+		if (split && queueToStabilize.size() >= CASCADE_SPLIT_SIZE)
+		{
+			std::vector<Vector2i> half(queueToStabilize.begin() + queueToStabilize.size() / 2, queueToStabilize.end());
+			queueToStabilize.resize(queueToStabilize.size() / 2);
+			Scheduler().Spawn([this, half]() mutable { StabilizeSedimentQueue<Classes>(half); });
+		}
+
 		Vector2i current = queueToStabilize[0];
 		queueToStabilize.erase(queueToStabilize.begin());
 		int id = ToIndex1D(current);
@@ -96,24 +227,29 @@ void DuneSediment::StabilizeSedimentRelative(int i, int j)
 			continue;
 
 		// Compute flow in all directions
-		n = CheckSedimentFlowRelative(current, tanThresholdAngleSediment, pts, s);
+		n = CheckSedimentFlowRelative(current, SedimentRepose(current.x, current.y), pts, s);
 		if (n == 0)
 			continue;
 
-		// Distribute to neighbours
+		// Distribute to neighbours, the sand carries the mix of the current point
+		float mix[MaxSedimentClasses];
+		if (Classes)
+			sedimentMix.Get(current.x, current.y).ToFloats(mix);
 		for (int a = 0; a < n; a++)
 		{
 			int nID = ToIndex1D(pts[a]);
-#pragma omp atomic
-			sediments[nID] += matterToMove * s[a];
+			if (Classes)
+				MixSedimentClasses(pts[a].x, pts[a].y, sediments.Get(nID), mix, matterToMove * s[a]);
+			sediments.FetchAdd(nID, matterToMove * s[a]);
+			sediments.RefreshGhost(pts[a].x, pts[a].y, boundary);
 
 			// Push neighbour to latter check stabilization
 			queueToStabilize.push_back(pts[a]);
 		}
 
 		// Remove sediments from the current point
-#pragma omp atomic
-		sediments[id] -= matterToMove;
+		sediments.FetchAdd(id, -matterToMove);
+		sediments.RefreshGhost(current.x, current.y, boundary);
 	}
 }
 
@@ -136,7 +272,7 @@ bool DuneSediment::StabilizeBedrockRelative(int i, int j)
 		Vector2i current = queueToStabilize[0];
 
 		// Compute flow in all directions
-		n = CheckBedrockFlowRelative(current, tanThresholdAngleBedrock, pts, s);
+		n = CheckBedrockFlowRelative(current, BedrockRepose(current.x, current.y), pts, s);
 		if (n == 0)
 		{
 			queueToStabilize.erase(queueToStabilize.begin());
@@ -148,16 +284,16 @@ bool DuneSediment::StabilizeBedrockRelative(int i, int j)
 		for (int a = 0; a < n; a++)
 		{
 			int nID = ToIndex1D(pts[a]);
-#pragma omp atomic
-			bedrock[nID] += matterToMove * s[a];
+			bedrock.FetchAdd(nID, matterToMove * s[a]);
+			bedrock.RefreshGhost(pts[a].x, pts[a].y, boundary);
 
 			// Push neighbour to latter check stabilization
 			queueToStabilize.push_back(pts[a]);
 		}
 
 		// Remove sediments from the current point
-#pragma omp atomic
-		bedrock[ToIndex1D(current)] -= matterToMove;
+		bedrock.FetchAdd(ToIndex1D(current), -matterToMove);
+		bedrock.RefreshGhost(current.x, current.y, boundary);
 	}
 	return stabilized;
 }
@@ -166,6 +302,99 @@ bool DuneSediment::StabilizeBedrockRelative(int i, int j)
 \brief Stabilization function for the bedrock layer.
 */
 void DuneSediment::StabilizeBedrockAll()
+{
+	std::vector<Vector2i> allPoints;
+	for (int i = 0; i < nx; i++)
+	{
+		for (int j = 0; j < ny; j++)
+			allPoints.push_back(Vector2i(i, j));
+	}
+	StabilizeBedrockPoints(allPoints);
+	ResetAbradedCells();
+}
+
+/*!
+\brief Stabilization of the bedrock around the cells abraded since the last stabilization, in a band of rows.
+Only abraded cells and their neighbours can have become unstable, the cascades then propagate outward.
+Cells are ordered by height within each tile, so that the cost depends on the abrasion activity rather
+than on the size of the grid.
+\param slice index of the band
+\param slices number of bands
+*/
+void DuneSediment::StabilizeBedrockSlice(int slice, int slices)
+{
+	const int tilesX = (nx + AbrasionTileSize - 1) / AbrasionTileSize;
+	const int tilesY = (ny + AbrasionTileSize - 1) / AbrasionTileSize;
+	const int tileBegin = slice * tilesX / slices;
+	const int tileEnd = (slice + 1) * tilesX / slices;
+	const int rowBegin = tileBegin * AbrasionTileSize;
+	const int rowEnd = Math::Min(tileEnd * AbrasionTileSize, nx);
+
+	// Lowering a cell steepens the slopes of its neighbours towards it: flag the neighbours as well,
+	// neighbours outside of the band are stabilized right away
+	std::vector<Vector2i> points;
+	for (int ti = tileBegin; ti < tileEnd; ti++)
+	{
+		for (int tj = 0; tj < tilesY; tj++)
+		{
+			if (abradedTiles[ti * tilesY + tj] == 0)
+				continue;
+			const int iEnd = Math::Min((ti + 1) * AbrasionTileSize, nx);
+			const int jEnd = Math::Min((tj + 1) * AbrasionTileSize, ny);
+			for (int i = ti * AbrasionTileSize; i < iEnd; i++)
+			{
+				for (int j = tj * AbrasionTileSize; j < jEnd; j++)
+				{
+					if (abradedCells[i * ny + j] != 1)
+						continue;
+					for (int k = 0; k < 8; k++)
+					{
+						Vector2i q = SnapGrid(Next(i, j, k));
+						if (q.x < rowBegin || q.x >= rowEnd)
+							points.push_back(q);
+						else if (abradedCells[q.x * ny + q.y] == 0)
+						{
+							abradedCells[q.x * ny + q.y] = 2;
+							abradedTiles[(q.x / AbrasionTileSize) * tilesY + q.y / AbrasionTileSize] = 1;
+						}
+					}
+				}
+			}
+		}
+	}
+	StabilizeBedrockPoints(points);
+
+	for (int ti = tileBegin; ti < tileEnd; ti++)
+	{
+		for (int tj = 0; tj < tilesY; tj++)
+		{
+			if (abradedTiles[ti * tilesY + tj] == 0)
+				continue;
+			abradedTiles[ti * tilesY + tj] = 0;
+
+			points.clear();
+			const int iEnd = Math::Min((ti + 1) * AbrasionTileSize, nx);
+			const int jEnd = Math::Min((tj + 1) * AbrasionTileSize, ny);
+			for (int i = ti * AbrasionTileSize; i < iEnd; i++)
+			{
+				for (int j = tj * AbrasionTileSize; j < jEnd; j++)
+				{
+					if (abradedCells[i * ny + j] == 0)
+						continue;
+					abradedCells[i * ny + j] = 0;
+					points.push_back(Vector2i(i, j));
+				}
+			}
+			StabilizeBedrockPoints(points);
+		}
+	}
+}
+
+/*!
+\brief Stabilize the bedrock from a set of cells, from the lowest to the highest.
+\param points cells, sorted in place
+*/
+void DuneSediment::StabilizeBedrockPoints(std::vector<Vector2i>& points)
 {
 	struct SortPredicate
 	{
@@ -174,16 +403,292 @@ void DuneSediment::StabilizeBedrockAll()
 
 		inline bool operator()(Vector2i a, Vector2i b) const
 		{
-			return duneModel->Bedrock(a.x, a.y) < duneModel->Bedrock(b.x, b.y);
+			return duneModel->bedrock.Get(a.x, a.y) < duneModel->bedrock.Get(b.x, b.y);
 		}
 	};
-	std::vector<Vector2i> allPoints;
+	std::sort(points.begin(), points.end(), SortPredicate(this));
+	for (int i = 0; i < points.size(); i++)
+		StabilizeBedrockRelative(points[i].x, points[i].y);
+}
+
+/*!
+\brief Clear the abraded cells, and allocate them for the current grid resolution.
+*/
+void DuneSediment::ResetAbradedCells()
+{
+	const int tiles = ((nx + AbrasionTileSize - 1) / AbrasionTileSize) * ((ny + AbrasionTileSize - 1) / AbrasionTileSize);
+	abradedCells.assign(nx * ny, 0);
+	abradedTiles.assign(tiles, 0);
+}
+
+/*!
+\brief Returns the number of cells abraded since the last bedrock stabilization.
+*/
+int DuneSediment::AbradedCells() const
+{
+	int n = 0;
+	for (int k = 0; k < int(abradedCells.size()); k++)
+		n += abradedCells[k] != 0 ? 1 : 0;
+	return n;
+}
+
+/*!
+\brief Wake all the tiles up, and forget their activity. Called when the terrain is modified outside of the simulation.
+*/
+void DuneSediment::ResetSleepingTiles()
+{
+	const int tiles = ((nx + SleepTileSize - 1) / SleepTileSize) * ((ny + SleepTileSize - 1) / SleepTileSize);
+	tileMass.clear();
+	tileQuiet.assign(tiles, 0);
+	tileWake.assign(tiles, 0);
+}
+
+/*!
+\brief Measure the activity of every tile at the end of a step. A tile is quiet if its sediment mass barely changed,
+no grain landed in it while it was sleeping, and its sand does not exceed the angle of repose. The slopes are only
+checked in the tiles whose mass is steady.
+*/
+void DuneSediment::UpdateSleepingTiles()
+{
+	const int tilesY = (ny + SleepTileSize - 1) / SleepTileSize;
+	const int tiles = int(tileQuiet.size());
+	const bool measured = !tileMass.empty();
+	tileMass.resize(tiles, 0.0f);
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+	for (int t = 0; t < tiles; t++)
+	{
+		const int i0 = (t / tilesY) * SleepTileSize, i1 = Math::Min(i0 + SleepTileSize, nx);
+		const int j0 = (t % tilesY) * SleepTileSize, j1 = Math::Min(j0 + SleepTileSize, ny);
+		double mass = 0.0;
+		for (int i = i0; i < i1; i++)
+			for (int j = j0; j < j1; j++)
+				mass += sediments.Get(i, j);
+
+		bool quiet = measured && fabs(mass - tileMass[t]) <= sleepMassTolerance && tileWake[t] == 0;
+		for (int i = i0; i < i1 && quiet; i++)
+		{
+			for (int j = j0; j < j1 && quiet; j++)
+			{
+				const int id = ToIndex1D(i, j);
+				if (sediments.Get(id) <= 0.0f)
+					continue;
+				const float h = bedrock.Get(id) + sediments.Get(id);
+				const float tanThresholdAngle = SedimentRepose(i, j);
+				for (int k = 0; k < 8; k++)
+				{
+					const float step = h - bedrock.Get(id + offset8[k]) - sediments.Get(id + offset8[k]);
+					quiet = quiet && step - tanThresholdAngle * cellSize / length8[k] <= sleepSlopeTolerance;
+				}
+			}
+		}
+		tileQuiet[t] = quiet ? tileQuiet[t] + 1 : 0;
+		tileMass[t] = float(mass);
+		tileWake[t] = 0;
+	}
+}
+
+/*!
+\brief Returns the number of sleeping tiles.
+*/
+int DuneSediment::SleepingTiles() const
+{
+	if (!sleepingTiles)
+		return 0;
+	int n = 0;
+	for (int t = 0; t < int(tileQuiet.size()); t++)
+		n += tileQuiet[t] >= sleepSteps ? 1 : 0;
+	return n;
+}
+
+/*!
+\brief Returns the number of tiles whose activity is tracked, see SetSleepingTiles().
+*/
+int DuneSediment::SleepTileCount() const
+{
+	return int(tileQuiet.size());
+}
+
+/*!
+\brief Resolve sand avalanches over the whole grid at once, as an alternative to the per-grain cascades
+of StabilizeSedimentRelative(). Each sweep reads the terrain of the previous sweep and writes a new
+sediment layer, so that all cells can be processed in parallel without atomics: every cell computes how
+much sand it loses, then gathers the sand its neighbours send to it. Sweeps are repeated until no cell
+moves more than the relaxation tolerance. Returns the number of sweeps.
+The mix of the sediment classes of the cells is not changed by the relaxation.
+*/
+int DuneSediment::RelaxSediments()
+{
+	if (relaxedSediments.SizeX() != nx || relaxedSediments.SizeY() != ny)
+	{
+		relaxedHeight = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ 1 });
+		relaxedFlow = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ 1 });
+		relaxedSediments = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ 1 });
+	}
+	if (!sedimentReposeOn && sedimentClasses.empty())
+	{
+		const float tanThresholdAngle = tanThresholdAngleSediment;
+		return RelaxSedimentSweeps([tanThresholdAngle](int) { return tanThresholdAngle; });
+	}
+
+	// Repose angles are decoded once per step, on the layout of the padded fields
+	if (relaxedRepose.SizeX() != nx || relaxedRepose.SizeY() != ny)
+		relaxedRepose = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ 1 });
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+	for (int i = 0; i < ny; i++)
+	{
+		float* row = relaxedRepose.Row(i);
+		for (int j = 0; j < nx; j++)
+			row[j] = SedimentRepose(i, j);
+	}
+	relaxedRepose.RefreshGhosts(boundary);
+	const float* repose = relaxedRepose.Data();
+	return RelaxSedimentSweeps([repose](int id) { return repose[id]; });
+}
+
+/*!
+\brief Relaxation sweeps, specialized for a uniform or a per-cell repose angle.
+\param repose returns the tangent of the repose angle of the sand leaving a cell, given its index in the padded fields
+*/
+template<typename Repose>
+int DuneSediment::RelaxSedimentSweeps(const Repose& repose)
+{
+	// Neighbours outside of a clamped domain are walls: sand neither leaves nor enters the grid
+	const float wall = 1e10f;
+	float* h = relaxedHeight.Data();
+	float* f = relaxedFlow.Data();
+
+	int sweep = 0;
+	while (sweep < relaxationMaxIterations)
+	{
+		const float* sed = sediments.Data();
+		float* next = relaxedSediments.Data();
+
+		// Total elevation, on aligned rows
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+		for (int i = 0; i < ny; i++)
+		{
+			const float* rockRow = bedrock.Row(i);
+			const float* sedRow = sediments.Row(i);
+			float* hRow = relaxedHeight.Row(i);
+			for (int j = 0; j < nx; j++)
+				hRow[j] = rockRow[j] + sedRow[j];
+		}
+		if (boundary == BoundaryMode::Periodic)
+			relaxedHeight.RefreshGhosts(boundary);
+		else
+			relaxedHeight.FillGhosts(wall);
+
+		// (1) Sand leaving every cell: half of the largest excess over the repose angle,
+		// distributed to the lower neighbours in proportion to their slope.
+		float maxFlow = 0.0f;
+#pragma omp parallel num_threads(OMP_NUM_THREAD)
+		{
+			float threadMaxFlow = 0.0f;
+#pragma omp for
+			for (int i = 0; i < ny; i++)
+			{
+				for (int j = 0; j < nx; j++)
+				{
+					const int id = ToIndex1D(i, j);
+					const float tanThresholdAngle = repose(id);
+					float slopesum = 0.0f;
+					float excess = 0.0f;
+					for (int k = 0; k < 8; k++)
+					{
+						const float step = h[id] - h[id + offset8[k]];
+						const bool flows = step > 0.0 && (step / cellSize * length8[k]) > tanThresholdAngle;
+						slopesum += flows ? step / length8[k] : 0.0f;
+						excess = Math::Max(excess, flows ? step - tanThresholdAngle * cellSize / length8[k] : 0.0f);
+					}
+					const float q = Math::Min(Math::Max(sed[id], 0.0f), 0.5f * excess);
+					f[id] = slopesum > 0.0f ? q / slopesum : 0.0f;
+					next[id] = sed[id] - q;
+					threadMaxFlow = Math::Max(threadMaxFlow, q);
+				}
+			}
+#pragma omp critical
+			maxFlow = Math::Max(maxFlow, threadMaxFlow);
+		}
+		if (maxFlow < relaxationTolerance)
+			break;
+		if (boundary == BoundaryMode::Periodic)
+			relaxedFlow.RefreshGhosts(boundary);
+		else
+			relaxedFlow.FillGhosts(0.0f);
+
+		// (2) Gather the sand coming from the higher neighbours
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+		for (int i = 0; i < ny; i++)
+		{
+			for (int j = 0; j < nx; j++)
+			{
+				const int id = ToIndex1D(i, j);
+				float in = 0.0f;
+				for (int k = 0; k < 8; k++)
+				{
+					const int nid = id + offset8[k];
+					const float step = h[nid] - h[id];
+					const bool flows = step > 0.0 && (step / cellSize * length8[k]) > repose(nid);
+					in += flows ? f[nid] * (step / length8[k]) : 0.0f;
+				}
+				next[id] += in;
+			}
+		}
+
+		// Double buffering
+		sediments.Swap(relaxedSediments);
+		sweep++;
+	}
+	sediments.RefreshGhosts(boundary);
+	return sweep;
+}
+
+/*!
+\brief Set a repose angle per cell for the sand, for instance steeper for wet or cemented sand.
+Angles are quantized by half degrees.
+\param degrees repose angles in degrees, over the grid of the terrain, in the world frame
+*/
+void DuneSediment::SetSedimentRepose(const ScalarField2D& degrees)
+{
+	sedimentRepose = ByteField2D(nx, ny, box, uint8_t(0));
 	for (int i = 0; i < nx; i++)
 	{
 		for (int j = 0; j < ny; j++)
-			allPoints.push_back(Vector2i(i, j));
+		{
+			const Vector2i w = WorldCell(i, j);
+			sedimentRepose.Set(i, j, ReposeTangents::Quantize(degrees.Get(w.x, w.y)));
+		}
 	}
-	std::sort(allPoints.begin(), allPoints.end(), SortPredicate(this));
-	for (int i = 0; i < allPoints.size(); i++)
-		StabilizeBedrockRelative(allPoints[i].x, allPoints[i].y);
+	sedimentReposeOn = true;
+}
+
+/*!
+\brief Set a repose angle per cell for the bedrock, for instance to mix hard and soft rocks.
+Angles are quantized by half degrees.
+\param degrees repose angles in degrees, over the grid of the terrain, in the world frame
+*/
+void DuneSediment::SetBedrockRepose(const ScalarField2D& degrees)
+{
+	bedrockRepose = ByteField2D(nx, ny, box, uint8_t(0));
+	for (int i = 0; i < nx; i++)
+	{
+		for (int j = 0; j < ny; j++)
+		{
+			const Vector2i w = WorldCell(i, j);
+			bedrockRepose.Set(i, j, ReposeTangents::Quantize(degrees.Get(w.x, w.y)));
+		}
+	}
+	bedrockReposeOn = true;
+}
+
+/*!
+\brief Go back to the uniform repose angles of the sand and of the bedrock.
+*/
+void DuneSediment::ClearRepose()
+{
+	sedimentRepose = ByteField2D();
+	bedrockRepose = ByteField2D();
+	relaxedRepose = ScalarField2D();
+	sedimentReposeOn = false;
+	bedrockReposeOn = false;
 }
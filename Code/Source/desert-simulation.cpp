@@ -1,6 +1,11 @@
 #include "desert.h"
 #include "noise.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <numeric>
 #include <omp.h>
 
 // File scope variables
@@ -9,84 +14,861 @@
 
 static float abrasionEpsilon = 0.5;
 static Vector2i next8[8] = { Vector2i(1, 0), Vector2i(1, 1), Vector2i(0, 1), Vector2i(-1, 1), Vector2i(-1, 0), Vector2i(-1, -1), Vector2i(0, -1), Vector2i(1, -1) };
-static Vector2i Next(int i, int j, int k)
-{
-	return Vector2i(i, j) + next8[k];
-}
 
 /*!
 \brief Perform a simulation step.
+The transport kernel is selected once per step from the current features.
 */
 void DuneSediment::SimulationStepMultiThreadAtomic()
 {
-#pragma omp parallel num_threads(OMP_NUM_THREAD)
+	BeginSimulationStep();
+	(this->*SelectStepKernel())();
+	EndSimulationStep();
+}
+
+/*!
+\brief Allocate the buffers of the changes of a two-phase step, zero until the transport writes them.
+The turbulent wind of the step is evaluated before the wind of the cells.
+The edits made before the step stay in the history, but can no longer be undone, see Undo().
+*/
+void DuneSediment::BeginSimulationStep()
+{
+	if (stepMode == StepMode::TwoPhase && (sedimentChanges.SizeX() != nx || sedimentChanges.SizeY() != ny))
 	{
-#pragma omp for
-		for (int a = 0; a < nx; a++)
+		sedimentChanges = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ sediments.Border() });
+		sedimentLifts = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ sediments.Border() });
+		bedrockChanges = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ bedrock.Border() });
+	}
+	UpdateTurbulence();
+	PrepareAuxiliaryFields();
+}
+
+/*!
+\brief Compute the wind and shadows used by the step, unless they are computed on the fly by the grains.
+The flux engine always reads them from the fields, computed at the beginning of the step when not pipelined.
+In the pipelined mode, the fields of the current step were computed during the previous step, and the fields of
+the next step are computed from a snapshot of the terrain: the frozen sediment layer of a two-phase step,
+or a copy made here in parallel. The bedrock is read live. The computation is handed to a few threads of the
+transport, see SimulationStepBatch(): tasks spawned here with the work stealing execution, members of the OpenMP
+team otherwise. The flux engine computes them at the end of the step.
+*/
+void DuneSediment::PrepareAuxiliaryFields()
+{
+	if (auxiliaryMode == AuxiliaryMode::OnTheFly && engine == TransportEngine::Grains)
+		return;
+
+	AuxiliaryFields* fields[2] = { &auxiliary, &nextAuxiliary };
+	for (int f = 0; f < 2; f++)
+	{
+		if (fields[f]->shadow.SizeX() == nx && fields[f]->shadow.SizeY() == ny)
+			continue;
+		fields[f]->windX = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ 1 });
+		fields[f]->windY = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ 1 });
+		fields[f]->shadow = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ 1 });
+	}
+
+	if (auxiliaryMode != AuxiliaryMode::Pipelined || !auxiliaryValid)
+	{
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+		for (int i = 0; i < nx; i++)
+			ComputeAuxiliaryRows(auxiliary, sediments, i, i + 1, true);
+		auxiliaryValid = true;
+	}
+	if (auxiliaryMode != AuxiliaryMode::Pipelined)
+		return;
+
+	auxiliarySand = &sediments;
+	if (stepMode != StepMode::TwoPhase)
+	{
+		if (auxiliarySnapshot.SizeX() != nx || auxiliarySnapshot.SizeY() != ny || auxiliarySnapshot.Border() != sediments.Border())
+			auxiliarySnapshot = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ sediments.Border() });
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+		for (int t = 0; t < OMP_NUM_THREAD; t++)
+			auxiliarySnapshot.CopySlice(sediments, t, OMP_NUM_THREAD);
+		auxiliarySand = &auxiliarySnapshot;
+	}
+	if (execution == ExecutionMode::WorkStealing && engine == TransportEngine::Grains)
+	{
+		// The transport tasks share the pool: the threads are taken from the transport as the tasks are stolen
+		const ScalarField2D* sand = auxiliarySand;
+		for (int t = 0; t < auxiliaryThreads; t++)
 		{
-			for (int b = 0; b < ny; b++)
-				SimulationStepWorldSpace();
+			const int begin = t * nx / auxiliaryThreads;
+			const int end = (t + 1) * nx / auxiliaryThreads;
+			Scheduler().Spawn(auxiliaryTasks, [this, sand, begin, end]() { ComputeAuxiliaryRows(nextAuxiliary, *sand, begin, end); });
 		}
+		auxiliarySand = nullptr;
 	}
-	EndSimulationStep();
 }
 
 /*!
-\brief Some operations are performed every five iteration
-to improve computation time.
+\brief Compute the wind and shadows of a band of rows.
+\param fields output fields
+\param sand sediment layer
+\param begin, end band of rows
+\param frozen true if the terrain is not modified during the computation, see IsInShadow()
+*/
+void DuneSediment::ComputeAuxiliaryRows(AuxiliaryFields& fields, const ScalarField2D& sand, int begin, int end, bool frozen) const
+{
+	Vector2 windDir;
+	for (int i = begin; i < end; i++)
+	{
+		for (int j = 0; j < ny; j++)
+		{
+			const int id = ToIndex1D(i, j);
+			ComputeWindAtCell(sand, i, j, windDir);
+			fields.windX.Set(id, windDir.x);
+			fields.windY.Set(id, windDir.y);
+			fields.shadow.Set(id, IsInShadow(sand, i, j, windDir, frozen));
+		}
+	}
+}
+
+/*!
+\brief Wind at a given cell, as seen by the grain transport.
+*/
+template<typename Policy>
+inline void DuneSediment::TransportWind(int i, int j, Vector2& windDir) const
+{
+	if (Policy::OnTheFly)
+	{
+		ComputeWindAtCell(i, j, windDir);
+		return;
+	}
+	const int id = ToIndex1D(i, j);
+	windDir = Vector2(auxiliary.windX.Get(id), auxiliary.windY.Get(id));
+}
+
+/*!
+\brief Probability of wind shadowing at a given cell, as seen by the grain transport.
+\param windDir wind at the cell, given by TransportWind()
+*/
+template<typename Policy>
+inline float DuneSediment::TransportShadow(int i, int j, const Vector2& windDir) const
+{
+	if (Policy::OnTheFly)
+		return IsInShadow(i, j, windDir);
+	return auxiliary.shadow.Get(i, j);
+}
+
+/*!
+\brief Returns the transport kernel specialized for the set of features currently turned on, or the flux engine.
+*/
+DuneSediment::StepKernel DuneSediment::SelectStepKernel() const
+{
+	if (engine == TransportEngine::Flux)
+		return &DuneSediment::SimulationStepFlux;
+	static const StepKernel* kernels = StepKernels(std::make_integer_sequence<int, FeatureCombinations>());
+	const int features = (vegetationOn ? VegetationFeature : 0)
+		| (abrasionOn ? AbrasionFeature : 0)
+		| (reptationOn ? ReptationFeature : 0)
+		| (shadowOn ? ShadowFeature : 0)
+		| (avalanche == AvalancheMode::PerGrain && stepMode == StepMode::InPlace ? CascadeFeature : 0)
+		| (!sedimentClasses.empty() ? SedimentClassFeature : 0)
+		| (stepMode == StepMode::TwoPhase ? TwoPhaseFeature : 0)
+		| (auxiliaryMode == AuxiliaryMode::OnTheFly ? OnTheFlyFeature : 0);
+	return kernels[features];
+}
+
+/*!
+\brief Instantiate the transport kernels for a list of feature combinations. Cascades are never
+performed by a two-phase step: these combinations share the kernel without cascades.
+*/
+template<int... Features>
+const DuneSediment::StepKernel* DuneSediment::StepKernels(std::integer_sequence<int, Features...>)
+{
+	static const StepKernel kernels[] = { &DuneSediment::SimulationStepBatch<SimulationPolicy<(Features & TwoPhaseFeature) != 0 ? (Features & ~CascadeFeature) : Features> >... };
+	return kernels;
+}
+
+/*!
+\brief Returns the work stealing thread pool, shared by all the simulations.
+*/
+TaskScheduler& DuneSediment::Scheduler()
+{
+	static TaskScheduler scheduler(OMP_NUM_THREAD);
+	return scheduler;
+}
+
+/*!
+\brief Returns the built-in maintenance tasks, indexed by MaintenanceTask.
+The bedrock is stabilized every five iterations to improve computation time.
+*/
+std::vector<PeriodicTask> DuneSediment::DefaultPeriodicTasks()
+{
+	std::vector<PeriodicTask> tasks(MaintenanceTasks);
+
+	// Bedrock stabilization is required if abrasion is turned on
+	// To avoid unrealistic bedrock shapes. However, the repose angle of the material
+	// Can be changed (we use 68 degrees, see desert.h static variables).
+	tasks[BedrockStabilizationTask].name = "bedrock stabilization";
+	tasks[BedrockStabilizationTask].period = 5;
+	tasks[BedrockStabilizationTask].function = [](DuneSediment& dune, int slice, int slices)
+	{
+		if (dune.abrasionOn)
+			dune.StabilizeBedrockSlice(slice, slices);
+	};
+
+	tasks[StatisticsTask].name = "statistics";
+	tasks[StatisticsTask].function = [](DuneSediment& dune, int slice, int slices) { dune.GatherStatistics(slice, slices); };
+
+	// Ghost cells are kept up to date by every write, the rebuild is a safety net
+	tasks[GhostRefreshTask].name = "ghost refresh";
+	tasks[GhostRefreshTask].period = 1;
+	tasks[GhostRefreshTask].function = [](DuneSediment& dune, int, int) { dune.RefreshGhostCells(); };
+
+	// The solved wind lags behind the terrain by a few steps, see SetWindSolver()
+	tasks[WindSolverTask].name = "wind solver";
+	tasks[WindSolverTask].period = 10;
+	tasks[WindSolverTask].function = [](DuneSediment& dune, int slice, int)
+	{
+		if (dune.windSolverOn && slice == 0)
+			dune.SolveWind();
+	};
+	return tasks;
+}
+
+/*!
+\brief Add the changes of a two-phase step to the terrain, resolve avalanches by relaxation
+if cascades were not performed by the grains or if the flux engine transported the sand, then run the periodic tasks due at the current step.
 */
 void DuneSediment::EndSimulationStep()
 {
-	static int simulationStepCount = 0;
+	if (auxiliaryMode == AuxiliaryMode::Pipelined)
+	{
+		Scheduler().Wait(auxiliaryTasks);
+		if (auxiliarySand != nullptr)
+		{
+			// Not handed to the transport, as with the flux engine
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+			for (int i = 0; i < nx; i++)
+				ComputeAuxiliaryRows(nextAuxiliary, *auxiliarySand, i, i + 1);
+			auxiliarySand = nullptr;
+		}
+		auxiliary.windX.Swap(nextAuxiliary.windX);
+		auxiliary.windY.Swap(nextAuxiliary.windY);
+		auxiliary.shadow.Swap(nextAuxiliary.shadow);
+	}
+	if (stepMode == StepMode::TwoPhase)
+		ApplyStepChanges();
+	if (avalanche == AvalancheMode::Relaxation || stepMode == StepMode::TwoPhase || engine == TransportEngine::Flux)
+		RelaxSediments();
+	if (sleepingTiles)
+		UpdateSleepingTiles();
+
+	stepCount++;
+	for (int t = 0; t < int(periodicTasks.size()); t++)
+	{
+		PeriodicTask& task = periodicTasks[t];
+		if (task.period <= 0)
+			continue;
+		const int phase = stepCount % task.period;
+		for (int k = 0; k < task.slices; k++)
+		{
+			if (phase == ((k + 1) * task.period / task.slices) % task.period)
+				task.function(*this, k, task.slices);
+		}
+	}
+}
+
+/*!
+\brief Add the changes accumulated by a two-phase step to the terrain, and zero them for the next step in the same pass.
+Abrasion only changes the tiles flagged since the last bedrock stabilization, the other tiles are skipped.
+*/
+void DuneSediment::ApplyStepChanges()
+{
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+	for (int i = 0; i < nx; i++)
+	{
+		float* sand = sediments.Row(i);
+		float* changes = sedimentChanges.Row(i);
+		float* lifts = sedimentLifts.Row(i);
+		for (int j = 0; j < ny; j++)
+		{
+			sand[j] += changes[j];
+			changes[j] = 0.0f;
+			lifts[j] = 0.0f;
+		}
+	}
+
+	if (abrasionOn)
+	{
+		const int tilesX = (nx + AbrasionTileSize - 1) / AbrasionTileSize;
+		const int tilesY = (ny + AbrasionTileSize - 1) / AbrasionTileSize;
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+		for (int t = 0; t < tilesX * tilesY; t++)
+		{
+			if (abradedTiles[t] == 0)
+				continue;
+			const int i0 = (t / tilesY) * AbrasionTileSize, j0 = (t % tilesY) * AbrasionTileSize;
+			for (int i = i0; i < Math::Min(i0 + AbrasionTileSize, nx); i++)
+			{
+				float* rock = bedrock.Row(i);
+				float* changes = bedrockChanges.Row(i);
+				for (int j = j0; j < Math::Min(j0 + AbrasionTileSize, ny); j++)
+				{
+					rock[j] += changes[j];
+					changes[j] = 0.0f;
+				}
+			}
+		}
+		bedrock.RefreshGhosts(boundary);
+	}
+	sediments.RefreshGhosts(boundary);
+}
+
+/*!
+\brief Change the cadence of a periodic task.
+\param task index of the task, either a MaintenanceTask or returned by AddPeriodicTask()
+\param period number of steps between two complete runs, 0 disables the task
+\param slices number of steps one run is spread across, clamped to the period
+*/
+void DuneSediment::SetTaskPeriod(int task, int period, int slices)
+{
+	periodicTasks[task].period = Math::Max(period, 0);
+	periodicTasks[task].slices = Math::Clamp(slices, 1, Math::Max(period, 1));
+}
+
+/*!
+\brief Returns the number of steps between two complete runs of a periodic task, 0 if it is disabled.
+\param task index of the task
+*/
+int DuneSediment::TaskPeriod(int task) const
+{
+	return periodicTasks[task].period;
+}
+
+/*!
+\brief Add a periodic task, such as exports or checkpoints. The function receives the simulation,
+so that the task remains valid when the simulation is copied.
+\param name name of the task
+\param period number of steps between two complete runs
+\param slices number of steps one run is spread across
+\param function operation, called with the simulation, the index of the slice and the number of slices
+\return the index of the task
+*/
+int DuneSediment::AddPeriodicTask(const std::string& name, int period, int slices, const PeriodicTask::Function& function)
+{
+	PeriodicTask task;
+	task.name = name;
+	task.function = function;
+	periodicTasks.push_back(task);
+	SetTaskPeriod(int(periodicTasks.size()) - 1, period, slices);
+	return int(periodicTasks.size()) - 1;
+}
+
+/*!
+\brief Accumulate the statistics of a band of rows. The statistics returned by Statistics()
+are only replaced once the last slice is gathered.
+\param slice index of the band
+\param slices number of bands
+*/
+void DuneSediment::GatherStatistics(int slice, int slices)
+{
+	if (slice == 0)
+	{
+		pendingStatistics = TerrainStatistics();
+		pendingStatistics.minHeight = Height(0, 0);
+		pendingStatistics.maxHeight = Height(0, 0);
+	}
+	for (int i = slice * nx / slices; i < (slice + 1) * nx / slices; i++)
+	{
+		for (int j = 0; j < ny; j++)
+		{
+			const float s = sediments.Get(i, j);
+			const float h = bedrock.Get(i, j) + s;
+			pendingStatistics.sediments += s;
+			pendingStatistics.minHeight = Math::Min(pendingStatistics.minHeight, h);
+			pendingStatistics.maxHeight = Math::Max(pendingStatistics.maxHeight, h);
+			pendingStatistics.maxSediment = Math::Max(pendingStatistics.maxSediment, s);
+		}
+	}
+	if (slice == slices - 1)
+	{
+		pendingStatistics.step = stepCount;
+		statistics = pendingStatistics;
+	}
+}
+
+/*!
+\brief Capture the terrain and the progress of the simulation, to fork branches with Restore().
+Should be called between two steps.
+\param base previous snapshot, usually the one the simulation was restored from: the tiles that did not change
+since are shared with it, or nullptr
+*/
+DuneSnapshot DuneSediment::Snapshot(const DuneSnapshot* base) const
+{
+	DuneSnapshot snapshot;
+	snapshot.step = stepCount;
+	snapshot.windRotation = windRotation;
+	snapshot.wind = wind;
+	snapshot.statistics = statistics;
+	snapshot.pendingStatistics = pendingStatistics;
+	snapshot.bedrock = TiledField2D(bedrock, base != nullptr ? &base->bedrock : nullptr);
+	snapshot.sediments = TiledField2D(sediments, base != nullptr ? &base->sediments : nullptr);
+	snapshot.vegetation = TiledField2D(vegetation, base != nullptr ? &base->vegetation : nullptr);
+	if (base != nullptr && base->abradedCells != nullptr && *base->abradedCells == abradedCells)
+		snapshot.abradedCells = base->abradedCells;
+	else
+		snapshot.abradedCells = std::make_shared<const std::vector<unsigned char> >(abradedCells);
+	if (!sedimentClasses.empty())
+		snapshot.sedimentMix = TiledHalf4Field2D(sedimentMix, base != nullptr ? &base->sedimentMix : nullptr);
+	return snapshot;
+}
+
+/*!
+\brief Replace the terrain and the progress of the simulation with a snapshot, for instance to run
+several branches from the same state with different winds. The parameters and modes of the simulation
+are kept. The grid of the simulation must be the grid of the snapshot. When the simulation has sediment classes,
+their fractions are restored from the snapshot, or reset to the initial fractions of the classes if the snapshot
+was taken without classes. Snapshots taken before the abraded cells were recorded restore them as not abraded.
+Throws std::invalid_argument if the grid of the snapshot differs, leaving the simulation unchanged.
+*/
+void DuneSediment::Restore(const DuneSnapshot& snapshot)
+{
+	if (snapshot.bedrock.SizeX() != nx || snapshot.bedrock.SizeY() != ny
+		|| snapshot.sediments.SizeX() != nx || snapshot.sediments.SizeY() != ny
+		|| snapshot.vegetation.SizeX() != nx || snapshot.vegetation.SizeY() != ny
+		|| (snapshot.sedimentMix.Tiles() > 0 && (snapshot.sedimentMix.SizeX() != nx || snapshot.sedimentMix.SizeY() != ny))
+		|| (snapshot.abradedCells != nullptr && snapshot.abradedCells->size() != size_t(nx) * size_t(ny)))
+		throw std::invalid_argument("DuneSediment: snapshot of a different grid");
 
-#pragma omp atomic
-	simulationStepCount++;
+	stepCount = snapshot.step;
+	RotateReposeFields((snapshot.windRotation - windRotation + 4) % 4);
+	if (!sedimentClasses.empty())
+	{
+		if (snapshot.sedimentMix.Tiles() > 0)
+			snapshot.sedimentMix.Restore(sedimentMix);
+		else
+			ResetSedimentMix();
+	}
+	windRotation = snapshot.windRotation;
+	wind = snapshot.wind;
+	statistics = snapshot.statistics;
+	pendingStatistics = snapshot.pendingStatistics;
+	snapshot.bedrock.Restore(bedrock);
+	snapshot.sediments.Restore(sediments);
+	snapshot.vegetation.Restore(vegetation);
 
-	if (simulationStepCount % 5 == 0)
+	ResetAbradedCells();
+	if (snapshot.abradedCells != nullptr)
 	{
-		// Bedrock stabilization is required if abrasion is turned on
-		// To avoid unrealistic bedrock shapes. However, the repose angle of the material
-		// Can be changed (we use 68 degrees, see desert.h static variables).
-		if (abrasionOn)
-			StabilizeBedrockAll();
+		const std::vector<unsigned char>& cells = *snapshot.abradedCells;
+		const int tilesY = (ny + AbrasionTileSize - 1) / AbrasionTileSize;
+		for (int i = 0; i < nx; i++)
+		{
+			for (int j = 0; j < ny; j++)
+			{
+				abradedCells[i * ny + j] = cells[i * ny + j];
+				if (abradedCells[i * ny + j] != 0)
+					abradedTiles[(i / AbrasionTileSize) * tilesY + j / AbrasionTileSize] = 1;
+			}
+		}
 	}
+	ClearHistory();
+	ResetSleepingTiles();
+	auxiliaryValid = false;
+	RefreshGhostCells();
+	if (windSolverOn)
+		SolveWind();
+}
+
+/*!
+\brief Compute the memory used by the snapshot, excluding the data shared with a given snapshot.
+\param base snapshot, or nullptr to count all the data
+*/
+size_t DuneSnapshot::Memory(const DuneSnapshot* base) const
+{
+	size_t memory = sizeof(DuneSnapshot);
+	memory += bedrock.Memory(base != nullptr ? &base->bedrock : nullptr);
+	memory += sediments.Memory(base != nullptr ? &base->sediments : nullptr);
+	memory += vegetation.Memory(base != nullptr ? &base->vegetation : nullptr);
+	if (abradedCells != nullptr && (base == nullptr || base->abradedCells != abradedCells))
+		memory += abradedCells->size();
+	if (sedimentMix.Tiles() > 0)
+		memory += sedimentMix.Memory(base != nullptr ? &base->sedimentMix : nullptr);
+	return memory;
+}
+
+/*!
+\brief Compute the memory used by an edit record.
+*/
+size_t EditRecord::Memory() const
+{
+	return sizeof(EditRecord) + name.size() + sizeof(int) * tiles.size() + sizeof(uint32_t) * deltas.size();
+}
+
+/*!
+\brief Append the run-length encoding of a delta: groups of a number of zero words, a number of literal words
+and the literal words, until all the words are covered.
+*/
+static void EncodeDelta(const std::vector<uint32_t>& delta, std::vector<uint32_t>& out)
+{
+	const int n = int(delta.size());
+	int k = 0;
+	while (k < n)
+	{
+		int zeros = 0;
+		while (k + zeros < n && delta[k + zeros] == 0)
+			zeros++;
+		k += zeros;
+		int literals = 0;
+		while (k + literals < n && delta[k + literals] != 0)
+			literals++;
+		out.push_back(uint32_t(zeros));
+		out.push_back(uint32_t(literals));
+		out.insert(out.end(), delta.begin() + k, delta.begin() + k + literals);
+		k += literals;
+	}
+}
+
+/*!
+\brief Read the bits of a cell of a layer of the edit records: one word for the bedrock, sediment and vegetation
+layers, two words for the four halves of the sediment mix.
+\param layer index of the layer, the mix being the fourth one
+\param i, j cell
+\param words bits of the cell
+\return the number of words
+*/
+int DuneSediment::EditWords(int layer, int i, int j, uint32_t* words) const
+{
+	if (layer == 3)
+	{
+		const Half4 mix = sedimentMix.Get(i, j);
+		std::memcpy(words, &mix, sizeof(mix));
+		return 2;
+	}
+	const ScalarField2D* layers[3] = { &bedrock, &sediments, &vegetation };
+	const float v = layers[layer]->Get(i, j);
+	std::memcpy(words, &v, sizeof(v));
+	return 1;
+}
+
+/*!
+\brief Write the bits of a cell of a layer of the edit records, see EditWords().
+*/
+void DuneSediment::SetEditWords(int layer, int i, int j, const uint32_t* words)
+{
+	if (layer == 3)
+	{
+		Half4 mix;
+		std::memcpy(&mix, words, sizeof(mix));
+		sedimentMix.Set(i, j, mix);
+		return;
+	}
+	ScalarField2D* layers[3] = { &bedrock, &sediments, &vegetation };
+	float v;
+	std::memcpy(&v, words, sizeof(v));
+	layers[layer]->Set(i, j, v);
+	layers[layer]->RefreshGhost(i, j, boundary);
+}
+
+/*!
+\brief Apply an edit to the terrain, recording the touched tiles in the undo history.
+The redo history is discarded, and the oldest edits are evicted when the history exceeds its memory cap.
+With sediment classes, the sand added by the edit has the initial mix of the classes, and the mix is recorded
+with the terrain layers. Removed sand leaves the mix of the cell unchanged.
+\param name name of the edit
+\param region region of the world that the operation may modify
+\param operation applied to every cell of the region
+*/
+void DuneSediment::Edit(const std::string& name, const Box2D& region, const EditOperation& operation)
+{
+	// Cells of the region in the simulation frame
+	int iMin = nx, iMax = -1, jMin = ny, jMax = -1;
+	for (int k = 0; k < 4; k++)
+	{
+		const Vector2 corner((k & 1) ? region[1][0] : region[0][0], (k & 2) ? region[1][1] : region[0][1]);
+		int i, j;
+		bedrock.CellInteger(FramePoint(corner), i, j);
+		iMin = Math::Min(iMin, i);
+		iMax = Math::Max(iMax, i);
+		jMin = Math::Min(jMin, j);
+		jMax = Math::Max(jMax, j);
+	}
+	iMin = Math::Clamp(iMin - 1, 0, nx - 1);
+	iMax = Math::Clamp(iMax + 1, 0, nx - 1);
+	jMin = Math::Clamp(jMin - 1, 0, ny - 1);
+	jMax = Math::Clamp(jMax + 1, 0, ny - 1);
+
+	// Values of the touched tiles before the edit
+	const int tilesY = (ny + EditTileSize - 1) / EditTileSize;
+	EditRecord record;
+	record.name = name;
+	record.step = stepCount;
+	record.layers = sedimentClasses.empty() ? 3 : 4;
+	for (int ti = iMin / EditTileSize; ti <= iMax / EditTileSize; ti++)
+		for (int tj = jMin / EditTileSize; tj <= jMax / EditTileSize; tj++)
+			record.tiles.push_back(ti * tilesY + tj);
+	std::vector<uint32_t> before;
+	uint32_t words[2];
+	for (int t = 0; t < int(record.tiles.size()); t++)
+	{
+		const int i0 = (record.tiles[t] / tilesY) * EditTileSize, j0 = (record.tiles[t] % tilesY) * EditTileSize;
+		for (int l = 0; l < record.layers; l++)
+			for (int i = i0; i < Math::Min(i0 + EditTileSize, nx); i++)
+				for (int j = j0; j < Math::Min(j0 + EditTileSize, ny); j++)
+					before.insert(before.end(), words, words + EditWords(l, i, j, words));
+	}
+
+	// Edit the cells whose world position lies in the region
+	float fractions[MaxSedimentClasses];
+	InitialSedimentFractions(fractions);
+	ScalarField2D* layers[3] = { &bedrock, &sediments, &vegetation };
+	const Vector2 a = region[0], b = region[1];
+	for (int i = iMin; i <= iMax; i++)
+	{
+		for (int j = jMin; j <= jMax; j++)
+		{
+			const Vector2i w = WorldCell(i, j);
+			const Vector2 p = bedrock.ArrayVertex(w.x, w.y);
+			if (p[0] < a[0] || p[0] > b[0] || p[1] < a[1] || p[1] > b[1])
+				continue;
+			float rock = bedrock.Get(i, j), sand = sediments.Get(i, j), plants = vegetation.Get(i, j);
+			operation(p, rock, sand, plants);
+			if (!sedimentClasses.empty() && sand > sediments.Get(i, j))
+				MixSedimentClasses(i, j, sediments.Get(i, j), fractions, sand - sediments.Get(i, j));
+			bedrock.Set(i, j, rock);
+			sediments.Set(i, j, sand);
+			vegetation.Set(i, j, plants);
+			for (int l = 0; l < 3; l++)
+				layers[l]->RefreshGhost(i, j, boundary);
+		}
+	}
+
+	// Deltas of the touched tiles
+	std::vector<uint32_t> delta;
+	int k = 0;
+	for (int t = 0; t < int(record.tiles.size()); t++)
+	{
+		const int i0 = (record.tiles[t] / tilesY) * EditTileSize, j0 = (record.tiles[t] % tilesY) * EditTileSize;
+		for (int l = 0; l < record.layers; l++)
+		{
+			delta.clear();
+			for (int i = i0; i < Math::Min(i0 + EditTileSize, nx); i++)
+			{
+				for (int j = j0; j < Math::Min(j0 + EditTileSize, ny); j++)
+				{
+					const int n = EditWords(l, i, j, words);
+					for (int w = 0; w < n; w++)
+						delta.push_back(before[k++] ^ words[w]);
+				}
+			}
+			EncodeDelta(delta, record.deltas);
+		}
+	}
+
+	// Drop the edits that could be redone, then evict the oldest edits beyond the cap
+	while (int(history.size()) > historyPosition)
+	{
+		historyMemory -= history.back().Memory();
+		history.pop_back();
+	}
+	historyMemory += record.Memory();
+	history.push_back(std::move(record));
+	historyPosition++;
+	SetHistoryCapacity(historyCapacity);
+	ResetSleepingTiles();
+	auxiliaryValid = false;
+}
+
+/*!
+\brief Apply the deltas of an edit record, which both undoes and redoes the edit.
+*/
+void DuneSediment::ApplyEditRecord(const EditRecord& record)
+{
+	const int tilesY = (ny + EditTileSize - 1) / EditTileSize;
+	const uint32_t* in = record.deltas.data();
+	uint32_t words[2];
+	for (int t = 0; t < int(record.tiles.size()); t++)
+	{
+		const int i0 = (record.tiles[t] / tilesY) * EditTileSize, j0 = (record.tiles[t] % tilesY) * EditTileSize;
+		const int rows = Math::Min(EditTileSize, nx - i0), columns = Math::Min(EditTileSize, ny - j0);
+		for (int l = 0; l < record.layers; l++)
+		{
+			// Words of the cells, one per cell for the terrain layers, two for the mix
+			const int n = l == 3 ? 2 : 1;
+			int k = 0;
+			while (k < n * rows * columns)
+			{
+				k += int(*in++);
+				const int literals = int(*in++);
+				for (int c = 0; c < literals; c++, k++)
+				{
+					const int i = i0 + (k / n) / columns, j = j0 + (k / n) % columns;
+					EditWords(l, i, j, words);
+					words[k % n] ^= *in++;
+					SetEditWords(l, i, j, words);
+				}
+			}
+		}
+	}
+	ResetSleepingTiles();
+	auxiliaryValid = false;
+}
+
+/*!
+\brief Undo the last applied edit. Edits made before the last simulation step cannot be undone: the step
+modified the terrain their deltas apply to.
+Returns false if there is no edit to undo.
+*/
+bool DuneSediment::Undo()
+{
+	if (historyPosition == 0 || history[historyPosition - 1].step != stepCount)
+		return false;
+	historyPosition--;
+	ApplyEditRecord(history[historyPosition]);
+	return true;
+}
+
+/*!
+\brief Redo the last undone edit, unless a simulation step was performed since.
+Returns false if there is no edit to redo.
+*/
+bool DuneSediment::Redo()
+{
+	if (historyPosition == int(history.size()) || history[historyPosition].step != stepCount)
+		return false;
+	ApplyEditRecord(history[historyPosition]);
+	historyPosition++;
+	return true;
+}
+
+/*!
+\brief Forget all the edits. Called when the terrain is replaced or turned, or when the sediment classes change:
+the deltas of the history no longer apply.
+*/
+void DuneSediment::ClearHistory()
+{
+	history.clear();
+	historyPosition = 0;
+	historyMemory = 0;
+}
+
+/*!
+\brief Change the memory cap of the edit history, evicting the oldest edits beyond it.
+The last edit is always kept.
+\param bytes memory cap
+*/
+void DuneSediment::SetHistoryCapacity(size_t bytes)
+{
+	historyCapacity = bytes;
+	while (historyMemory > historyCapacity && history.size() > 1)
+	{
+		historyMemory -= history.front().Memory();
+		history.pop_front();
+		historyPosition = Math::Max(historyPosition - 1, 0);
+	}
+}
+
+/*!
+\brief Brush adding sand with a smooth radial falloff, or removing it with a negative height.
+\param center center of the brush, in world coordinates
+\param radius radius of the brush
+\param height thickness added at the center
+*/
+void DuneSediment::AddSediments(const Vector2& center, float radius, float height)
+{
+	Edit("sediments", Box2D(center, radius), [center, radius, height](const Vector2& p, float&, float& sand, float&)
+	{
+		const float d = Magnitude(p - center) / radius;
+		if (d < 1.0f)
+			sand = Math::Max(0.0f, sand + height * (1.0f - d * d) * (1.0f - d * d));
+	});
+}
+
+/*!
+\brief Brush raising the bedrock with a smooth radial falloff, or lowering it with a negative height.
+\param center center of the brush, in world coordinates
+\param radius radius of the brush
+\param height elevation added at the center
+*/
+void DuneSediment::AddBedrock(const Vector2& center, float radius, float height)
+{
+	Edit("bedrock", Box2D(center, radius), [center, radius, height](const Vector2& p, float& rock, float&, float&)
+	{
+		const float d = Magnitude(p - center) / radius;
+		if (d < 1.0f)
+			rock += height * (1.0f - d * d) * (1.0f - d * d);
+	});
+}
+
+/*!
+\brief Reserve the sand of a grain lifted from a cell during a two-phase step. The decision only depends on the
+terrain of the beginning of the step and on the sand already lifted from the cell, never on the deposits of the step.
+\param id cell
+\param mass sand lifted by the grain
+\return false if the sand of the cell was already lifted by other grains
+*/
+bool DuneSediment::ReserveLift(int id, float mass)
+{
+	const float sand = sediments.Get(id);
+	bool lifted = false;
+	sedimentLifts.FetchUpdate(id, [sand, mass, &lifted](float l)
+	{
+		lifted = l < sand;
+		return lifted ? l + mass : l;
+	});
+	return lifted;
 }
 
 /*!
 \brief Main simulation entry point. This function performs
-a single simulation step at a random cell in the terrain.
+a single simulation step at a given cell in the terrain.
+Features disabled in the policy are compiled out of the kernel.
+\param startI, startJ lift site, randomly selected
+\return the cell the grain landed in, or (-1, -1) if no grain was lifted or the grain left the terrain
 */
-void DuneSediment::SimulationStepWorldSpace()
+template<typename Policy>
+inline Vector2i DuneSediment::SimulationStepWorldSpace(int startI, int startJ)
 {
 	Vector2 windDir;
 
-	// (1) Select a random grid position (Lifting)
-	int startI = Random::Integer() % nx;
-	int startJ = Random::Integer() % ny;
+	// (1) Lifting
 	int start1D = ToIndex1D(startI, startJ);
 
+	// Terrain is read from sediments, changes are written to out: the same layer, unless the step is two-phase
+	ScalarField2D& out = Policy::TwoPhase ? sedimentChanges : sediments;
+
 	// Compute wind at start cell
-	ComputeWindAtCell(startI, startJ, windDir);
+	TransportWind<Policy>(startI, startJ, windDir);
 
 	// No sediment to move
 	if (sediments.Get(start1D) <= 0.0)
-		return;
+		return Vector2i(-1, -1);
 	// Wind shadowing probability
-	if (Random::Uniform() < IsInShadow(startI, startJ, windDir))
+	if (Policy::Shadow && Random::Uniform() < TransportShadow<Policy>(startI, startJ, windDir))
 	{
-		StabilizeSedimentRelative(startI, startJ);
-		return;
+		if (Policy::Cascades)
+			StabilizeSedimentRelative<Policy::Classes>(startI, startJ);
+		return Vector2i(-1, -1);
 	}
 	// Vegetation can retain sediments in the lifting process
-	if (vegetationOn && Random::Uniform() < vegetation[start1D])
+	if (Policy::Vegetation && Random::Uniform() < vegetation[start1D])
 	{
-		StabilizeSedimentRelative(startI, startJ);
-		return;
+		if (Policy::Cascades)
+			StabilizeSedimentRelative<Policy::Classes>(startI, startJ);
+		return Vector2i(-1, -1);
 	}
 
-	// (2) Lift grain at start cell
-#pragma omp atomic
-	sediments[start1D] -= matterToMove;
+	// (2) Lift grain at start cell, of a class drawn from the active layer of the cell
+	float mass = matterToMove;
+	float hop = 1.0f;
+	float grain[MaxSedimentClasses] = { 0.0f };
+	if (Policy::Classes)
+	{
+		const int c = DrawSedimentClass(startI, startJ);
+		mass *= sedimentClasses[c].mass;
+		hop = sedimentClasses[c].hop;
+		grain[c] = 1.0f;
+	}
+	// Grains already lifted from the cell during a two-phase step included
+	if (Policy::TwoPhase && !ReserveLift(start1D, mass))
+		return Vector2i(-1, -1);
+	if (Policy::Classes)
+		MixSedimentClasses(startI, startJ, sediments.Get(start1D), grain, -mass);
+	out.FetchAdd(start1D, -mass);
+	out.RefreshGhost(startI, startJ, boundary);
 
 	// (3) Jump downwind by saltation hop length (wind direction). Repeat until sand is deposited.
 	int destI = startI;
@@ -96,10 +878,10 @@ void DuneSediment::SimulationStepWorldSpace()
 	while (bounce < MAX_BOUNCE)
 	{
 		// Compute wind at the current cell
-		ComputeWindAtCell(destI, destJ, windDir);
+		TransportWind<Policy>(destI, destJ, windDir);
 
 		// Compute new world position and new grid position (after wind addition)
-		pos = pos + windDir;
+		pos = pos + (Policy::Classes ? windDir * hop : windDir);
 		SnapWorld(pos);
 		bedrock.CellInteger(pos, destI, destJ);
 
@@ -107,50 +889,387 @@ void DuneSediment::SimulationStepWorldSpace()
 		int destID = ToIndex1D(destI, destJ);
 
 		// Abrasion of the bedrock occurs with low sand supply, weak bedrock and a low probability.
-		if (abrasionOn && Random::Uniform() < 0.2 && sediments.Get(destID) < 0.5)
+		if (Policy::Abrasion && Random::Uniform() < 0.2 && sediments.Get(destID) < 0.5)
 			PerformAbrasionOnCell(destI, destJ, windDir);
 
 		// Probability of deposition
 		float p = Random::Uniform();
 
-		// Shadowed cell
-		if (p < IsInShadow(destI, destJ, windDir))
+		// Shadowed cell, sandy cell - 60% chance of deposition, empty cell - 40% chance of deposition (if vegetation == 0.0)
+		if ((Policy::Shadow && p < TransportShadow<Policy>(destI, destJ, windDir))
+			|| (sediments.Get(destID) > 0.0 && p < 0.6 + (Policy::Vegetation ? (vegetation.Get(destID) * 0.4) : 0.0))
+			|| (sediments.Get(destID) <= 0.0 && p < 0.4 + (Policy::Vegetation ? (vegetation.Get(destID) * 0.6) : 0.0)))
 		{
-#pragma omp atomic
-			sediments[destID] += matterToMove;
+			if (Policy::Classes)
+				MixSedimentClasses(destI, destJ, sediments.Get(destID), grain, mass);
+			out.FetchAdd(destID, mass);
+			out.RefreshGhost(destI, destJ, boundary);
 			break;
 		}
-		// Sandy cell - 60% chance of deposition (if vegetation == 0.0)
-		else if (sediments.Get(destID) > 0.0 && p < 0.6 + (vegetationOn ? (vegetation.Get(destID) * 0.4) : 0.0))
+
+		// Perform reptation at each bounce
+		bounce++;
+		if (Policy::Reptation && (!Policy::Vegetation || Random::Uniform() < 1.0 - vegetation[start1D]))
+			PerformReptationOnCell<Policy>(destI, destJ, bounce);
+	}
+	// End of the deposition loop - we have move matter from (startI, startJ) to (destI, destJ)
+
+	// Perform reptation at the deposition simulationStepCount
+	if (Policy::Reptation && (!Policy::Vegetation || Random::Uniform() < 1.0 - vegetation[start1D]))
+		PerformReptationOnCell<Policy>(destI, destJ, bounce);
+
+	// Avalanches are otherwise resolved at the end of the step
+	if (Policy::Cascades)
+	{
+		// (4) Check for the angle of repose on the original cell
+		StabilizeSedimentRelative<Policy::Classes>(startI, startJ);
+
+		// (5) Check for the angle of repose on the destination cell if different
+		StabilizeSedimentRelative<Policy::Classes>(destI, destJ);
+	}
+	return bounce < MAX_BOUNCE ? Vector2i(destI, destJ) : Vector2i(-1, -1);
+}
+
+/*!
+\brief Simulate the transport of nx * ny grains, with a kernel specialized for a given set of features.
+Records the time each thread spent transporting grains.
+*/
+template<typename Policy>
+void DuneSediment::SimulationStepBatch()
+{
+	// Grains are processed by rows of ny grains, or by tiles of lift sites
+	const int grains = PrepareGrainBudget();
+	PrepareLiftSampling(grains);
+	const int batches = liftOrder == LiftOrder::Tiled ? PrepareLiftSites(grains) : (grains + ny - 1) / ny;
+
+	if (execution == ExecutionMode::WorkStealing)
+	{
+		// One task per batch of grains, cascades are split on the fly. The group only waits for the transport,
+		// the auxiliary fields of the next step may still be computed by the pool.
+		TaskScheduler& scheduler = Scheduler();
+		TaskGroup transport;
+		for (int a = 0; a < batches; a++)
+			scheduler.Spawn(transport, [this, a, grains]() { SimulationStepGrains<Policy>(a, grains); });
+		scheduler.Wait(transport);
+		threadBusyTimes = transport.BusyTimes();
+		return;
+	}
+
+	// The first threads of the team compute the auxiliary fields of the next step, the others share the batches
+	const int helpers = auxiliarySand != nullptr ? Math::Clamp(auxiliaryThreads, 1, OMP_NUM_THREAD - 1) : 0;
+	const int threads = OMP_NUM_THREAD - helpers;
+	threadBusyTimes.assign(threads, 0.0);
+#pragma omp parallel num_threads(OMP_NUM_THREAD)
+	{
+		const int t = omp_get_thread_num();
+		if (t < helpers)
+			ComputeAuxiliaryRows(nextAuxiliary, *auxiliarySand, t * nx / helpers, (t + 1) * nx / helpers);
+		else
 		{
-#pragma omp atomic
-			sediments[destID] += matterToMove;
+			auto start = std::chrono::high_resolution_clock::now();
+			const int u = t - helpers;
+			for (int a = u * batches / threads; a < (u + 1) * batches / threads; a++)
+				SimulationStepGrains<Policy>(a, grains);
+			threadBusyTimes[u] = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+		}
+	}
+	auxiliarySand = nullptr;
+}
+
+/*!
+\brief Transport a batch of grains: a tile of pre-drawn lift sites in the tiled lift order,
+a row of ny grains drawn at the beginning of the batch otherwise. The lift sampling and the sleeping tiles
+are resolved once per batch.
+\param batch index of the batch
+\param grains number of grains of the step
+*/
+template<typename Policy>
+inline void DuneSediment::SimulationStepGrains(int batch, int grains)
+{
+	const Vector2i* sites = nullptr;
+	int n = 0;
+	if (liftOrder == LiftOrder::Tiled)
+	{
+		sites = liftSites.data() + liftBins[batch];
+		n = liftBins[batch + 1] - liftBins[batch];
+	}
+	else
+	{
+		// Lift sites of the batch, kept by each thread from one batch to the next
+		static thread_local std::vector<Vector2i> drawn;
+		const int begin = batch * ny;
+		const int end = Math::Min((batch + 1) * ny, grains);
+		drawn.resize(end - begin);
+		DrawLiftSiteRange(begin, end, drawn.data());
+		sites = drawn.data();
+		n = end - begin;
+	}
+	if (sleepingTiles)
+		SimulationStepSites<Policy, true>(sites, n);
+	else
+		SimulationStepSites<Policy, false>(sites, n);
+}
+
+/*!
+\brief Transport the grains of a list of lift sites.
+\param sites, n lift sites
+*/
+template<typename Policy, bool Sleeping>
+inline void DuneSediment::SimulationStepSites(const Vector2i* sites, int n)
+{
+	for (int k = 0; k < n; k++)
+	{
+		if (Sleeping && SkipSleepingLift(sites[k]))
+			continue;
+		const Vector2i dest = SimulationStepWorldSpace<Policy>(sites[k].x, sites[k].y);
+		if (Sleeping && dest.x >= 0)
+			WakeTile(dest.x, dest.y);
+	}
+}
+
+/*!
+\brief Compute the number of grains lifted by the current step. Except with the grid budget, grains are only
+lifted from the cells covered with sediments at the beginning of the step, which are gathered here: bare cells
+no longer cost anything, and a budget of one grain per active cell transports as much sand as the grid budget.
+The count is kept for GrainCount().
+*/
+int DuneSediment::PrepareGrainBudget()
+{
+	lastGrainCount = 0;
+	if (grainBudget == GrainBudgetMode::Grid)
+	{
+		lastGrainCount = nx * ny;
+		return lastGrainCount;
+	}
+
+	// Rows are counted, then filled, in parallel: the offset of a row is the number of active cells before it,
+	// so that the cells are gathered in the order of the grid whatever the number of threads.
+	activeRows.resize(nx + 1);
+	activeRows[0] = 0;
+	double mobile = 0.0;
+#pragma omp parallel for reduction(+:mobile) num_threads(OMP_NUM_THREAD)
+	for (int i = 0; i < nx; i++)
+	{
+		int count = 0;
+		for (int j = 0; j < ny; j++)
+		{
+			const float s = sediments.Get(i, j);
+			if (s <= 0.0f)
+				continue;
+			count++;
+			mobile += Math::Min(s, matterToMove);
+		}
+		activeRows[i + 1] = count;
+	}
+	for (int i = 0; i < nx; i++)
+		activeRows[i + 1] += activeRows[i];
+	activeCells.resize(activeRows[nx]);
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+	for (int i = 0; i < nx; i++)
+	{
+		int k = activeRows[i];
+		for (int j = 0; j < ny; j++)
+		{
+			if (sediments.Get(i, j) > 0.0f)
+				activeCells[k++] = Vector2i(i, j);
+		}
+	}
+	if (activeCells.empty())
+		return 0;
+
+	double grains = grainBudgetValue;
+	if (grainBudget == GrainBudgetMode::PerActiveCell)
+		grains *= double(activeCells.size());
+	else if (grainBudget == GrainBudgetMode::MobileMass)
+		grains *= mobile / matterToMove;
+	lastGrainCount = int(Math::Clamp(grains, 0.0, double(std::numeric_limits<int>::max())));
+	return lastGrainCount;
+}
+
+/*!
+\brief Draw the random state shared by the lift sites of the step, so that each site only depends on the index
+of its grain and can be computed by any thread. The lattice and permutation samplings visit the cells with an affine
+map k = (stride * grain + shift) mod n: a stride coprime with n makes it a permutation, computed without any buffer.
+The lattice takes the stride closest to n times the golden ratio, so that the first grains are evenly spread,
+the permutation a random one.
+\param grains number of grains of the step
+*/
+void DuneSediment::PrepareLiftSampling(int grains)
+{
+	liftGrains = grains;
+	liftOffset = Random::Uniform();
+	if (liftSampling != LiftSampling::LowDiscrepancy && liftSampling != LiftSampling::Permutation)
+		return;
+
+	const int n = grainBudget == GrainBudgetMode::Grid ? nx * ny : int(activeCells.size());
+	if (n < 2)
+	{
+		liftStride = 1;
+		liftShift = 0;
+		return;
+	}
+	const double goldenRatio = 0.61803398874989484820;
+	const int stride = liftSampling == LiftSampling::LowDiscrepancy ? int(n * goldenRatio + 0.5) : 1 + Random::Integer(n - 1);
+	// Closest stride coprime with n, searched on both sides: n and n - 1 are coprime, so the search ends
+	for (int d = 0; ; d++)
+	{
+		if (stride + d < n && std::gcd(stride + d, n) == 1)
+		{
+			liftStride = stride + d;
 			break;
 		}
-		// Empty cell - 40% chance of deposition (if vegetation == 0.0)
-		else if (sediments.Get(destID) <= 0.0 && p < 0.4 + (vegetationOn ? (vegetation.Get(destID) * 0.6) : 0.0))
+		if (stride - d > 0 && std::gcd(stride - d, n) == 1)
 		{
-#pragma omp atomic
-			sediments[destID] += matterToMove;
+			liftStride = stride - d;
 			break;
 		}
+	}
+	liftShift = Random::Integer(n);
+}
 
-		// Perform reptation at each bounce
-		bounce++;
-		if (Random::Uniform() < 1.0 - vegetation[start1D])
-			PerformReptationOnCell(destI, destJ, bounce);
+/*!
+\brief Select the cells a range of grains are lifted from, on the grid or among the active cells depending on the
+grain budget. The site of a grain only depends on its index, except with the random sampling.
+\param begin, end range of grains of the step
+\param sites lift sites of the grains
+*/
+void DuneSediment::DrawLiftSiteRange(int begin, int end, Vector2i* sites) const
+{
+	if (grainBudget == GrainBudgetMode::Grid)
+		DrawLiftSiteRange(begin, end, sites, nx * ny, [this](int k) { return Vector2i(k / ny, k % ny); });
+	else
+		DrawLiftSiteRange(begin, end, sites, int(activeCells.size()), [this](int k) { return activeCells[k]; });
+}
+
+/*!
+\brief Select the cells a range of grains are lifted from, among n candidate cells. The sampling is resolved
+once for the range.
+\param begin, end range of grains of the step
+\param sites lift sites of the grains
+\param n number of candidate cells
+\param cell returns the candidate cell of a given index
+*/
+template<typename Cell>
+void DuneSediment::DrawLiftSiteRange(int begin, int end, Vector2i* sites, int n, const Cell& cell) const
+{
+	switch (liftSampling)
+	{
+	case LiftSampling::Random:
+		for (int g = begin; g < end; g++)
+			sites[g - begin] = cell(Random::Integer(n));
+		break;
+	case LiftSampling::Stratified:
+		// Grains share the cells in strata of n / liftGrains consecutive cells, shifted every step
+		for (int g = begin; g < end; g++)
+			sites[g - begin] = cell((int((double(g) + Random::Uniform()) * n / liftGrains) + int(liftOffset * n)) % n);
+		break;
+	case LiftSampling::LowDiscrepancy:
+	case LiftSampling::Permutation:
+		for (int g = begin; g < end; g++)
+			sites[g - begin] = cell(int(((long long)(g % n) * liftStride + liftShift) % n));
+		break;
 	}
-	// End of the deposition loop - we have move matter from (startI, startJ) to (destI, destJ)
+}
 
-	// Perform reptation at the deposition simulationStepCount
-	if (Random::Uniform() < 1.0 - vegetation[start1D])
-		PerformReptationOnCell(destI, destJ, bounce);
+/*!
+\brief Draw the lift sites of the grains of one step with the current grain budget and lift sampling, as the next
+step would, without transporting them. Sites are cells of the simulation frame.
+*/
+std::vector<Vector2i> DuneSediment::DrawLiftSites()
+{
+	const int grains = PrepareGrainBudget();
+	PrepareLiftSampling(grains);
+	std::vector<Vector2i> sites(grains);
+	DrawLiftSiteRange(0, grains, sites.data());
+	return sites;
+}
+
+/*!
+\brief Interleave the bits of two coordinates.
+*/
+static int Morton2D(int x, int y)
+{
+	int key = 0;
+	for (int b = 0; b < 15; b++)
+		key |= (((x >> b) & 1) << (2 * b + 1)) | (((y >> b) & 1) << (2 * b));
+	return key;
+}
 
-	// (4) Check for the angle of repose on the original cell
-	StabilizeSedimentRelative(startI, startJ);
+/*!
+\brief Draw the lift sites of the step and sort them by tile with a counting sort. Tiles are sorted in
+Morton order, so that the contiguous tiles given to a thread cover a compact region of the grid.
+The sites are drawn exactly as in the unsorted order, only the processing order changes. Each thread draws and
+counts a contiguous range of grains, and places them after the sites of the same tile drawn by the previous
+threads: the sorted order does not depend on the number of threads. Buffers are kept from one step to the next.
+\param grains number of grains of the step
+\return the number of tiles
+*/
+int DuneSediment::PrepareLiftSites(int grains)
+{
+	const int tiles = Math::Max((nx + LiftTileSize - 1) / LiftTileSize, (ny + LiftTileSize - 1) / LiftTileSize);
+	int side = 1;
+	while (side < tiles)
+		side *= 2;
+	const int bins = side * side;
 
-	// (5) Check for the angle of repose on the destination cell if different
-	StabilizeSedimentRelative(destI, destJ);
+	liftDrawn.resize(grains);
+	liftKeys.resize(grains);
+	liftSites.resize(grains);
+	liftBins.assign(bins + 1, 0);
+	liftCounts.assign(size_t(OMP_NUM_THREAD) * bins, 0);
+#pragma omp parallel num_threads(OMP_NUM_THREAD)
+	{
+		const int t = omp_get_thread_num();
+		const int threads = omp_get_num_threads();
+		const int begin = int((long long)(grains) * t / threads);
+		const int end = int((long long)(grains) * (t + 1) / threads);
+		int* counts = liftCounts.data() + size_t(t) * bins;
+		DrawLiftSiteRange(begin, end, liftDrawn.data() + begin);
+		for (int k = begin; k < end; k++)
+		{
+			liftKeys[k] = Morton2D(liftDrawn[k].x / LiftTileSize, liftDrawn[k].y / LiftTileSize);
+			counts[liftKeys[k]]++;
+		}
+#pragma omp barrier
+#pragma omp single
+		{
+			// Slots are ordered by tile, then by thread within a tile
+			int slot = 0;
+			for (int b = 0; b < bins; b++)
+			{
+				liftBins[b] = slot;
+				for (int u = 0; u < threads; u++)
+				{
+					const int count = liftCounts[size_t(u) * bins + b];
+					liftCounts[size_t(u) * bins + b] = slot;
+					slot += count;
+				}
+			}
+			liftBins[bins] = slot;
+		}
+		for (int k = begin; k < end; k++)
+			liftSites[counts[liftKeys[k]]++] = liftDrawn[k];
+	}
+	return bins;
+}
+
+/*!
+\brief Performs the reptation process as described in the paper, with the sediment layer and the sediment classes
+of the current step.
+*/
+void DuneSediment::PerformReptationOnCell(int i, int j, int bounce)
+{
+	if (stepMode == StepMode::TwoPhase)
+	{
+		if (sedimentClasses.empty())
+			PerformReptationOnCell<SimulationPolicy<TwoPhaseFeature> >(i, j, bounce);
+		else
+			PerformReptationOnCell<SimulationPolicy<TwoPhaseFeature | SedimentClassFeature> >(i, j, bounce);
+	}
+	else if (sedimentClasses.empty())
+		PerformReptationOnCell<SimulationPolicy<0> >(i, j, bounce);
+	else
+		PerformReptationOnCell<SimulationPolicy<SedimentClassFeature> >(i, j, bounce);
 }
 
 /*!
@@ -159,6 +1278,7 @@ Although some observations have been made in geomorphology about the impact
 of reptation, we didn't find any particular change with or without reptation activated.
 Still, implementation is provided if someone wants to try it.
 */
+template<typename Policy>
 void DuneSediment::PerformReptationOnCell(int i, int j, int bounce)
 {
 	// Compute amount of sand to creep; function of number of bounce.
@@ -166,13 +1286,18 @@ void DuneSediment::PerformReptationOnCell(int i, int j, int bounce)
 	float t = float(b) / 3.0f;
 	float se = Math::Lerp(matterToMove / 2.0f, matterToMove, t);
 	float rReptationSquared = 2.0 * 2.0;
-	Vector2 p = bedrock.ArrayVertex(i, j);
 
 	// Distribute sand at the 2-steepest neighbours
+	ScalarField2D& out = Policy::TwoPhase ? sedimentChanges : sediments;
 	Vector2i nei[8];
 	float nslope[8];
-	int n = Math::Min(2, CheckSedimentFlowRelative(Vector2i(i, j), tanThresholdAngleSediment, nei, nslope));
+	int n = Math::Min(2, CheckSedimentFlowRelative(Vector2i(i, j), SedimentRepose(i, j), nei, nslope));
 	int nEffective = 0;
+
+	// Creeping sand carries the mix of the cell, which leaves the mix of the cell unchanged
+	float mix[MaxSedimentClasses];
+	if (Policy::Classes)
+		sedimentMix.Get(i, j).ToFloats(mix);
 	for (int k = 0; k < n; k++)
 	{
 		Vector2i next = nei[k];
@@ -180,13 +1305,19 @@ void DuneSediment::PerformReptationOnCell(int i, int j, int bounce)
 
 		// We don't perform reptation if the grid discretization is too low.
 		// (If cells are too far away from each other in world space)
-		Vector2 pk = bedrock.ArrayVertex(next.x, next.y);
-		if (SquaredMagnitude(p - pk) > rReptationSquared)
+		// Neighbours may lie across a periodic border, so the distance is measured on the grid.
+		int di = next.x - i;
+		int dj = next.y - j;
+		di = di > 1 ? di - nx : (di < -1 ? di + nx : di);
+		dj = dj > 1 ? dj - ny : (dj < -1 ? dj + ny : dj);
+		if (cellSize * cellSize * float(di * di + dj * dj) > rReptationSquared)
 			continue;
 
 		// Distribute sediment to neighbour
-#pragma omp atomic
-		sediments[ToIndex1D(next)] += sei;
+		if (Policy::Classes)
+			MixSedimentClasses(next.x, next.y, sediments.Get(ToIndex1D(next)), mix, sei);
+		out.FetchAdd(ToIndex1D(next), sei);
+		out.RefreshGhost(next.x, next.y, boundary);
 
 		// Count the amount of neighbour which received sand from the current cell (i, j)
 		nEffective++;
@@ -195,8 +1326,8 @@ void DuneSediment::PerformReptationOnCell(int i, int j, int bounce)
 	// Remove sediment at the current cell
 	if (n > 0 && nEffective > 0)
 	{
-#pragma omp atomic
-		sediments[ToIndex1D(i, j)] -= se;
+		out.FetchAdd(ToIndex1D(i, j), -se);
+		out.RefreshGhost(i, j, boundary);
 	}
 }
 
@@ -207,17 +1338,31 @@ void DuneSediment::PerformReptationOnCell(int i, int j, int bounce)
 \param windDir wind direction
 */
 void DuneSediment::ComputeWindAtCell(int i, int j, Vector2& windDir) const
+{
+	ComputeWindAtCell(sediments, i, j, windDir);
+}
+
+/*!
+\brief Compute the wind direction at a given cell, over a given sediment layer.
+\param sand sediment layer
+\param i cell coordinate
+\param j cell coordinate
+\param windDir result wind direction
+*/
+void DuneSediment::ComputeWindAtCell(const ScalarField2D& sand, int i, int j, Vector2& windDir) const
 {
 	// Get altitude of the sand at current cell
-	const float sandHeight = sediments.Get(i, j);
-	windDir = (1.0f + (0.005f * sandHeight)) * wind; 
+	const float sandHeight = sand.Get(i, j);
+	windDir = windSolverOn ? SolvedWind(i, j) : (1.0f + (0.005f * sandHeight)) * wind; 
+	if (turbulenceAmplitude > 0.0f)
+		windDir = windDir + Vector2(turbulenceX.Get(i, j), turbulenceY.Get(i, j));
 
 	// If no wind
 	if (windDir.x < 0.001f && windDir.y < 0.001f)
 		return;
 
 	// Modulate wind strength with sediment layer: increase velocity on slope in the direction of the wind
-	Vector2 g = sediments.Gradient(i, j);
+	Vector2 g = sand.Gradient(i, j);
 	Vector2 orthogonalVec = Vector2(-g.y, g.x);
 	float slope = 0.0f;
 	// If the gradient is not 0 and the wind direction is not 0
@@ -234,14 +1379,89 @@ void DuneSediment::ComputeWindAtCell(int i, int j, Vector2& windDir) const
 	windDir = Math::Lerp(windDir, 5.0f * orthogonalVec, slope);
 }
 
+/*!
+\brief Evaluate the turbulent wind of the current step, a small cost per step independent of the number of grains.
+The stream function is a fractal noise of the world position and of the step, sampled at every cell and ghost cell
+with the vectorized noise. The wind is its curl, computed by central differences in the simulation frame.
+*/
+void DuneSediment::UpdateTurbulence()
+{
+	if (turbulenceAmplitude <= 0.0f)
+		return;
+	if (turbulenceX.SizeX() != nx || turbulenceX.SizeY() != ny)
+	{
+		turbulencePotential = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ 1 });
+		turbulenceX = ScalarField2D(nx, ny, box, 0.0f);
+		turbulenceY = ScalarField2D(nx, ny, box, 0.0f);
+	}
+
+	// Each octave halves the size of the eddies and divides the stream function by four, so that the wind halves
+	float norm = 0.0f;
+	for (int k = 0; k < turbulenceOctaves; k++)
+		norm += powf(0.5f, float(k));
+	const float time = turbulenceSpeed * float(stepCount);
+	const float amplitude = turbulenceAmplitude * turbulenceScale / norm;
+
+#pragma omp parallel num_threads(OMP_NUM_THREAD)
+	{
+		std::vector<float> x(ny + 2), y(ny + 2), px(ny + 2), py(ny + 2), noise(ny + 2);
+#pragma omp for
+		for (int i = -1; i <= nx; i++)
+		{
+			// Noise is a function of the world frame
+			for (int j = -1; j <= ny; j++)
+			{
+				const Vector2i w = WorldCell(i, j);
+				const Vector2 p = bedrock.ArrayVertex(w.x, w.y);
+				px[j + 1] = p[0] / turbulenceScale;
+				py[j + 1] = p[1] / turbulenceScale;
+			}
+			float* potential = turbulencePotential.Row(i) - 1;
+			std::fill(potential, potential + ny + 2, 0.0f);
+			float frequency = 1.0f;
+			float weight = amplitude;
+			for (int k = 0; k < turbulenceOctaves; k++)
+			{
+				for (int j = 0; j < ny + 2; j++)
+				{
+					x[j] = frequency * px[j];
+					y[j] = frequency * py[j];
+				}
+				PerlinNoise::GetValues(x.data(), y.data(), time, noise.data(), ny + 2);
+				for (int j = 0; j < ny + 2; j++)
+					potential[j] += weight * noise[j];
+				frequency *= 2.0f;
+				weight *= 0.25f;
+			}
+		}
+	}
+
+	// Wind (dpsi/dy, -dpsi/dx): rows follow the y axis of the world, columns the x axis
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+	for (int i = 0; i < nx; i++)
+	{
+		const float* below = turbulencePotential.Row(i - 1);
+		const float* row = turbulencePotential.Row(i);
+		const float* above = turbulencePotential.Row(i + 1);
+		float* windX = turbulenceX.Row(i);
+		float* windY = turbulenceY.Row(i);
+		for (int j = 0; j < ny; j++)
+		{
+			windX[j] = (above[j] - below[j]) / (2.0f * cellSize);
+			windY[j] = (row[j - 1] - row[j + 1]) / (2.0f * cellSize);
+		}
+	}
+}
+
 /*!
 \brief This functions performs the abrasion algorithm described in the paper,
 which is responsible for the creation of yardang features.
 \param i cell i
 \param j cell j
 \param windDir wind direction at this cell
+\param events expected number of grains abrading the cell, 1 for a single grain
 */
-void DuneSediment::PerformAbrasionOnCell(int i, int j, const Vector2& windDir)
+void DuneSediment::PerformAbrasionOnCell(int i, int j, const Vector2& windDir, float events)
 {
 	int id = ToIndex1D(i, j);
 
@@ -251,9 +1471,9 @@ void DuneSediment::PerformAbrasionOnCell(int i, int j, const Vector2& windDir)
 	// Bedrock resistance [0, 1] (1.0 equals to weak, 0.0 equals to hard)
 	// Here with a simple sin() function, but anything could be used: texture, noise, construction trees...
 	// In the paper, we used various noises octaves combined with each other.
-	// Note: To get a more interesting look on the yardangs, turbulent wind is required. It is not provided
-	// In this implementation.
-	const Vector2 p = bedrock.ArrayVertex(i, j);
+	// Note: To get a more interesting look on the yardangs, turbulent wind is required, see SetTurbulence().
+	const Vector2i world = WorldCell(i, j);
+	const Vector2 p = bedrock.ArrayVertex(world.x, world.y);
 	const float freq = 0.08f;
 	const float warp = 15.36f;
 	float h = (sinf((p.y * freq) + (warp * PerlinNoise::GetValue(0.05f * p))) + 1.0f) / 2.0f;
@@ -262,13 +1482,20 @@ void DuneSediment::PerformAbrasionOnCell(int i, int j, const Vector2& windDir)
 	float w = Math::Clamp(Magnitude(windDir), 0.0f, 2.0f);
 
 	// Abrasion strength, function of vegetation, hardness and wind speed.
-	float si = abrasionEpsilon * (1.0f - v) * (1.0f - h) * w;
+	float si = events * abrasionEpsilon * (1.0f - v) * (1.0f - h) * w;
 	if (si == 0.0)
 		return;
 
-	// Transform bedrock into dust
-#pragma omp atomic
-	bedrock[id] -= si;
+	// Transform bedrock into dust, deferred to the end of a two-phase step
+	ScalarField2D& rock = TransportedBedrock();
+	rock.FetchAdd(id, -si);
+	rock.RefreshGhost(i, j, boundary);
+
+	// Remember the cell for the next bedrock stabilization
+#pragma omp atomic write
+	abradedCells[i * ny + j] = 1;
+#pragma omp atomic write
+	abradedTiles[(i / AbrasionTileSize) * ((ny + AbrasionTileSize - 1) / AbrasionTileSize) + j / AbrasionTileSize] = 1;
 }
 
 /*!
@@ -280,6 +1507,21 @@ Use the threshold angle described in geomorphology papers, ie. ~[5, 15]�.
 \returns true of the vertex is in shadow, false otherwise.
 */
 float DuneSediment::IsInShadow(int i, int j, const Vector2& windDir) const
+{
+	return IsInShadow(sediments, i, j, windDir);
+}
+
+/*!
+\brief Check if a given grid vertex is in the wind shadow, over a given sediment layer.
+\param sand sediment layer
+\param i x coordinate
+\param j y coordinate
+\param unitWindDir unit wind direction.
+\param frozen true if neither the sediment layer nor the bedrock are modified during the call, so that the
+march may be sampled 8 at a time with plain gathers. The live terrain of a running transport is sampled
+with atomic loads.
+*/
+float DuneSediment::IsInShadow(const ScalarField2D& sand, int i, int j, const Vector2& windDir, bool frozen) const
 {
 	const float windStepLength = 1.0;
 
@@ -291,9 +1533,13 @@ float DuneSediment::IsInShadow(int i, int j, const Vector2& windDir) const
 	Vector2 p = bedrock.ArrayVertex(i, j);
 	Vector2 pShadow = p;
 	float rShadow = 10.0f;
-	float hp = Height(p);
-	float ret = 0.0;
-	while (true)
+	float hp = ScalarField2D::GetValueBilinearSum(bedrock, sand, p);
+
+	// Sample positions along the march, the heights of a frozen terrain are then sampled 8 at a time
+	const int maxSamples = 32;
+	float xs[maxSamples], ys[maxSamples], ds[maxSamples], hs[maxSamples];
+	int n = 0;
+	while (n < maxSamples)
 	{
 		pShadow = pShadow - windStep;
 		if (pShadow == p)
@@ -304,9 +1550,32 @@ float DuneSediment::IsInShadow(int i, int j, const Vector2& windDir) const
 		float d = Magnitude(p - pShadow);
 		if (d > rShadow)
 			break;
+		xs[n] = pShadowSnapped[0];
+		ys[n] = pShadowSnapped[1];
+		ds[n] = d;
+		n++;
+	}
+	if (frozen)
+	{
+		for (int k = n; k < ((n + 7) & ~7); k++)
+		{
+			xs[k] = p[0];
+			ys[k] = p[1];
+		}
+		for (int k = 0; k < n; k += 8)
+			ScalarField2D::GetValueBilinearSum8(bedrock, sand, xs + k, ys + k, hs + k);
+	}
+	else
+	{
+		for (int k = 0; k < n; k++)
+			hs[k] = ScalarField2D::GetValueBilinearSum(bedrock, sand, Vector2(xs[k], ys[k]));
+	}
 
-		float step = Height(pShadowSnapped) - hp;
-		float t = (step / d);
+	float ret = 0.0;
+	for (int k = 0; k < n; k++)
+	{
+		float step = hs[k] - hp;
+		float t = (step / ds[k]);
 		// Brennen: Update function to match the paper
 		float s = Math::Step(t, tanThresholdAngleWindShadowMin, tanThresholdAngleWindShadowMax);
 		ret = Math::Max(ret, s);
@@ -316,9 +1585,16 @@ float DuneSediment::IsInShadow(int i, int j, const Vector2& windDir) const
 
 /*!
 \brief Snaps the coordinates of a given point to stay within terrain boundaries.
+Points wrap around the domain with periodic boundaries, and are clamped on the border otherwise.
 */
 void DuneSediment::SnapWorld(Vector2& p) const
 {
+	if (boundary == BoundaryMode::Clamped)
+	{
+		p[0] = Math::Clamp(p[0], 0.0f, box.Size()[0] - 1e-3f);
+		p[1] = Math::Clamp(p[1], 0.0f, box.Size()[1] - 1e-3f);
+		return;
+	}
 	if (p[0] < 0)
 		p[0] = box.Size()[0] + p[0];
 	else if (p[0] >= box.Size()[0])
@@ -328,3 +1604,202 @@ void DuneSediment::SnapWorld(Vector2& p) const
 	else if (p[1] >= box.Size()[1])
 		p[1] = p[1] - box.Size()[1];
 }
+
+/*!
+\brief Snaps grid coordinates lying at most one cell outside of the grid back onto the grid,
+following the boundary mode. Used to convert ghost cells into the interior cells they mirror.
+*/
+Vector2i DuneSediment::SnapGrid(const Vector2i& q) const
+{
+	return Vector2i(ScalarField2D::GhostSource(q.x, nx, boundary), ScalarField2D::GhostSource(q.y, ny, boundary));
+}
+
+/*!
+\brief Refresh the ghost border of all terrain layers, and the neighbour offsets used by stencils.
+Called once per simulation step: during a step, neighbour reads across the border see the
+state of the terrain at the beginning of the step.
+*/
+void DuneSediment::RefreshGhostCells()
+{
+	bedrock.RefreshGhosts(boundary);
+	sediments.RefreshGhosts(boundary);
+	vegetation.RefreshGhosts(boundary);
+	for (int k = 0; k < 8; k++)
+		offset8[k] = bedrock.Offset(next8[k]);
+}
+
+/*!
+\brief Turn the simulation frame so that the base wind blows along +x, the direction of the rows of the fields.
+Marches along the wind, such as saltation hops and shadow tests, then read consecutive cells. Only quarter turns
+are used: they move the cells without resampling, hence without diffusing the terrain, and unlike mirrors they
+keep the deflection of the wind on slopes. The wind is therefore aligned up to 45 degrees, and exactly only when it
+blows along an axis of the grid. Quarter turns swap the axes, so non square grids are never aligned and stay in the
+world frame. Queries and exports are expressed in the world frame.
+\param aligned true to simulate in the wind aligned frame, false to go back to the world frame
+\return true if the simulation runs in a wind aligned frame, false if it runs in the world frame, including
+when the alignment was requested on a non square grid
+*/
+bool DuneSediment::SetWindAlignment(bool aligned)
+{
+	int target = 0;
+	if (aligned && nx == ny)
+	{
+		// Wind after k counterclockwise quarter turns
+		float best = -1.0f;
+		for (int k = 0; k < 4; k++)
+		{
+			Vector2 wk = wind;
+			for (int t = 0; t < k; t++)
+				wk = Vector2(-wk.y, wk.x);
+			if (wk.x > best)
+			{
+				best = wk.x;
+				target = (k + windRotation) % 4;
+			}
+		}
+	}
+	RotateFrame((target - windRotation + 4) % 4);
+	return aligned && nx == ny;
+}
+
+/*!
+\brief Move the cells of a square field.
+\param field the field
+\param move changes the coordinates of a cell into its new coordinates
+*/
+template<typename Field, typename Move>
+static void RotateField(Field& field, const Move& move)
+{
+	Field rotated(field.SizeX(), field.SizeY(), field.GetBox(), GhostBorder{ field.Border() });
+	for (int i = 0; i < field.SizeX(); i++)
+	{
+		for (int j = 0; j < field.SizeY(); j++)
+		{
+			int a = i, b = j;
+			move(a, b);
+			rotated.Set(a, b, field.Get(i, j));
+		}
+	}
+	field.Swap(rotated);
+}
+
+/*!
+\brief Turn the per-cell repose fields counterclockwise by a number of quarter turns, along with the frame.
+*/
+void DuneSediment::RotateReposeFields(int quarterTurns)
+{
+	auto Rotate = [this, quarterTurns](int& i, int& j)
+	{
+		for (int k = 0; k < quarterTurns; k++)
+		{
+			const int t = i;
+			i = j;
+			j = nx - 1 - t;
+		}
+	};
+	if (sedimentReposeOn)
+		RotateField(sedimentRepose, Rotate);
+	if (bedrockReposeOn)
+		RotateField(bedrockRepose, Rotate);
+}
+
+/*!
+\brief Turn the fields and the wind counterclockwise by a number of quarter turns.
+*/
+void DuneSediment::RotateFrame(int quarterTurns)
+{
+	if (quarterTurns == 0)
+		return;
+
+	// Cell (i, j) moves to (j, n - 1 - i) at each quarter turn
+	auto Rotate = [this, quarterTurns](int& i, int& j)
+	{
+		for (int k = 0; k < quarterTurns; k++)
+		{
+			const int t = i;
+			i = j;
+			j = nx - 1 - t;
+		}
+	};
+	ScalarField2D* fields[3] = { &bedrock, &sediments, &vegetation };
+	for (int f = 0; f < 3; f++)
+		RotateField(*fields[f], Rotate);
+	if (!sedimentClasses.empty())
+		RotateField(sedimentMix, Rotate);
+	RotateReposeFields(quarterTurns);
+	std::vector<unsigned char> abraded(abradedCells.size(), 0);
+	for (int i = 0; i < nx; i++)
+	{
+		for (int j = 0; j < ny; j++)
+		{
+			int a = i, b = j;
+			Rotate(a, b);
+			abraded[a * ny + b] = abradedCells[i * ny + j];
+			if (abraded[a * ny + b] != 0)
+				abradedTiles[(a / AbrasionTileSize) * ((ny + AbrasionTileSize - 1) / AbrasionTileSize) + b / AbrasionTileSize] = 1;
+		}
+	}
+	abradedCells.swap(abraded);
+
+	for (int k = 0; k < quarterTurns; k++)
+		wind = Vector2(-wind.y, wind.x);
+	windRotation = (windRotation + quarterTurns) % 4;
+	auxiliaryValid = false;
+	ClearHistory();
+	ResetSleepingTiles();
+	RefreshGhostCells();
+	if (windSolverOn)
+		SolveWind();
+}
+
+/*!
+\brief Returns the cell of the world frame stored in a given cell of the simulation frame.
+*/
+Vector2i DuneSediment::WorldCell(int i, int j) const
+{
+	for (int k = 0; k < windRotation; k++)
+	{
+		const int t = j;
+		j = i;
+		i = nx - 1 - t;
+	}
+	return Vector2i(i, j);
+}
+
+/*!
+\brief Returns the position in the simulation frame of a given point of the world frame.
+*/
+Vector2 DuneSediment::FramePoint(const Vector2& p) const
+{
+	const Vector2 size = box.Size();
+	Vector2 q = p - box.BottomLeft();
+	for (int k = 0; k < windRotation; k++)
+		q = Vector2(size.x - q.y, q.x);
+	return box.BottomLeft() + q;
+}
+
+/*!
+\brief Copy the bedrock and sediment layers, expressed in the world frame.
+*/
+void DuneSediment::WorldFields(ScalarField2D& rock, ScalarField2D& sand) const
+{
+	if (windRotation == 0)
+	{
+		rock = bedrock;
+		sand = sediments;
+		return;
+	}
+	rock = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ bedrock.Border() });
+	sand = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ sediments.Border() });
+	for (int i = 0; i < nx; i++)
+	{
+		for (int j = 0; j < ny; j++)
+		{
+			const Vector2i q = FrameCell(i, j);
+			rock.Set(i, j, bedrock.Get(q.x, q.y));
+			sand.Set(i, j, sediments.Get(q.x, q.y));
+		}
+	}
+	rock.RefreshGhosts(boundary);
+	sand.RefreshGhosts(boundary);
+}
@@ -0,0 +1,209 @@
+#include "tests.h"
+#include "desert.h"
+
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+#include <stdexcept>
+
+#define OMP_NUM_THREAD 8
+
+/*!
+\brief Print the outcome of a test.
+\param name name of the test
+\param passed outcome
+\param error measured error, printed with the outcome
+*/
+static bool Report(const char* name, bool passed, double error)
+{
+	std::cout << (passed ? "[passed] " : "[FAILED] ") << name << " (error " << error << ")" << std::endl;
+	return passed;
+}
+
+/*!
+\brief Threads add sand to the cells along the edges of a field and refresh their ghost images, as the grains do.
+No addition may be lost: the refresh of a cell must not write the interior cell back.
+*/
+bool TestGhostRefresh()
+{
+	const int n = 64;
+	const int adds = 20000;
+	bool passed = true;
+	const BoundaryMode modes[2] = { BoundaryMode::Periodic, BoundaryMode::Clamped };
+	for (int m = 0; m < 2; m++)
+	{
+		ScalarField2D field(n, n, Box2D(Vector2(0), Vector2(float(n))), 0.0f, GhostBorder{ 2 });
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+		for (int t = 0; t < OMP_NUM_THREAD; t++)
+		{
+			// Threads share the cells of the first two rows and columns, corners included
+			for (int k = 0; k < adds; k++)
+			{
+				const int c = (k * 7 + t) % (2 * n);
+				const int i = c < n ? k % 2 : c - n;
+				const int j = c < n ? c : k % 2;
+				field.FetchAdd(field.ToIndex1D(i, j), 1.0f);
+				field.RefreshGhost(i, j, modes[m]);
+			}
+		}
+		double sum = 0.0;
+		for (int i = 0; i < n; i++)
+			for (int j = 0; j < n; j++)
+				sum += field.Get(i, j);
+		const double error = fabs(sum - double(OMP_NUM_THREAD) * adds);
+		passed = Report(m == 0 ? "ghost refresh, periodic" : "ghost refresh, clamped", error == 0.0, error) && passed;
+	}
+	return passed;
+}
+
+/*!
+\brief Avalanches and reptation move sand between the cells without creating nor destroying it. They are run
+concurrently from many cells along the edges of a steep terrain, with abrasion off, and the sand is summed before
+and after, up to the rounding of the float additions. Saltation is not part of the test: grains still in the air
+after their last hop leave the terrain by design.
+*/
+bool TestMassConservation()
+{
+	const int band = 16;
+	bool passed = true;
+	const BoundaryMode modes[2] = { BoundaryMode::Periodic, BoundaryMode::Clamped };
+	for (int m = 0; m < 2; m++)
+	{
+		DuneSediment dune(Box2D(Vector2(0), Vector2(1024)), 0.0, 4.0, Vector2(0, 3));
+		dune.SetBoundaryMode(modes[m]);
+		const int n = 1024;
+		auto Sum = [&dune, n]()
+		{
+			double sum = 0.0;
+			for (int i = 0; i < n; i++)
+				for (int j = 0; j < n; j++)
+					sum += dune.Sediment(i, j);
+			return sum;
+		};
+		const double before = Sum();
+#pragma omp parallel for schedule(dynamic, 64) num_threads(OMP_NUM_THREAD)
+		for (int c = 0; c < 4 * band * n; c++)
+		{
+			// Bands along the four edges, visited in an interleaved order
+			const int e = c % 4;
+			const int k = (c / 4) % n;
+			const int d = c / (4 * n);
+			const int i = e == 0 ? d : (e == 1 ? n - 1 - d : k);
+			const int j = e == 0 || e == 1 ? k : (e == 2 ? d : n - 1 - d);
+			dune.PerformReptationOnCell(i, j, c % 4);
+			dune.StabilizeSedimentRelative(i, j);
+		}
+		const double error = fabs(Sum() - before);
+		passed = Report(m == 0 ? "mass conservation, periodic" : "mass conservation, clamped", error < 0.05, error) && passed;
+	}
+	return passed;
+}
+
+/*!
+\brief Grains of several sediment classes are transported by concurrent threads, which update the height and the mix
+of the cells with separate atomic accesses. After a few steps, the fractions of every cell must still be positive
+and sum to one, up to the rounding of the halves.
+*/
+bool TestSedimentMix()
+{
+	std::vector<SedimentClass> classes(3);
+	classes[0].fraction = 0.5f;
+	classes[1].fraction = 0.3f;
+	classes[1].mass = 1.5f;
+	classes[1].hop = 1.3f;
+	classes[2].fraction = 0.2f;
+	classes[2].mass = 0.5f;
+	classes[2].hop = 0.6f;
+	classes[2].repose = 38.0f;
+
+	DuneSediment dune(Box2D(Vector2(0), Vector2(1024)), 3.0, 5.0, Vector2(0, 3));
+	dune.SetSedimentClasses(classes, 0.5f);
+	for (int s = 0; s < 3; s++)
+		dune.SimulationStepMultiThreadAtomic();
+
+	const int n = 1024;
+	double error = 0.0;
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < n; j++)
+		{
+			double sum = 0.0;
+			for (int c = 0; c < int(classes.size()); c++)
+			{
+				const float f = dune.SedimentFraction(i, j, c);
+				error = Math::Max(error, double(-f));
+				sum += f;
+			}
+			error = Math::Max(error, fabs(sum - 1.0));
+		}
+	}
+	return Report("sediment mix", error < 0.005, error);
+}
+
+/*!
+\brief A snapshot is taken after a few steps of a simulation with sediment classes, the simulation goes on, and the
+snapshot is restored: the layers, the mix, the abraded cells and the step count must be those of the snapshot.
+Restoring a snapshot without abraded cells must clear them, and restoring the snapshot of another grid must throw.
+*/
+bool TestSnapshotRestore()
+{
+	std::vector<SedimentClass> classes(2);
+	classes[0].fraction = 0.6f;
+	classes[1].fraction = 0.4f;
+	classes[1].mass = 1.5f;
+
+	DuneSediment dune(Box2D(Vector2(0), Vector2(1024)), 3.0, 5.0, Vector2(0, 3));
+	dune.SetSedimentClasses(classes, 0.5f);
+	for (int s = 0; s < 2; s++)
+		dune.SimulationStepMultiThreadAtomic();
+
+	const int n = 1024;
+	std::vector<float> bedrock(n * n), sediments(n * n), fractions(n * n);
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < n; j++)
+		{
+			bedrock[i * n + j] = dune.Bedrock(i, j);
+			sediments[i * n + j] = dune.Sediment(i, j);
+			fractions[i * n + j] = dune.SedimentFraction(i, j, 1);
+		}
+	}
+	const int step = dune.StepCount();
+	const int abraded = dune.AbradedCells();
+	const DuneSnapshot snapshot = dune.Snapshot();
+
+	for (int s = 0; s < 2; s++)
+		dune.SimulationStepMultiThreadAtomic();
+	dune.Restore(snapshot);
+
+	double error = 0.0;
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < n; j++)
+		{
+			error = Math::Max(error, double(fabs(dune.Bedrock(i, j) - bedrock[i * n + j])));
+			error = Math::Max(error, double(fabs(dune.Sediment(i, j) - sediments[i * n + j])));
+			error = Math::Max(error, double(fabs(dune.SedimentFraction(i, j, 1) - fractions[i * n + j])));
+		}
+	}
+	bool passed = Report("snapshot round trip", error == 0.0 && dune.StepCount() == step && dune.AbradedCells() == abraded, error);
+
+	DuneSnapshot cleared = snapshot;
+	cleared.abradedCells = nullptr;
+	dune.Restore(cleared);
+	passed = Report("snapshot without abraded cells", dune.AbradedCells() == 0, double(dune.AbradedCells())) && passed;
+
+	DuneSnapshot other = snapshot;
+	other.bedrock = TiledField2D(ScalarField2D(n / 4, n / 4, Box2D(Vector2(0), Vector2(256)), 0.0f, GhostBorder{ 1 }));
+	bool thrown = false;
+	try
+	{
+		dune.Restore(other);
+	}
+	catch (const std::invalid_argument&)
+	{
+		thrown = true;
+	}
+	passed = Report("snapshot of another grid", thrown && dune.StepCount() == step, 0.0) && passed;
+	return passed;
+}
@@ -0,0 +1,268 @@
+#include "desert.h"
+
+#include <cmath>
+#include <vector>
+#include <omp.h>
+
+// File scope variables
+#define OMP_NUM_THREAD 8
+#define MAX_BOUNCE 3
+
+/*!
+\brief Transport the expected sand flux of every cell instead of individual grains.
+Every cell lifts the sand the grains of the step would lift on average, with the same shadowing and vegetation
+probabilities. The sand in the air then makes MAX_BOUNCE saltation hops along the wind: each hop deposits the
+fraction given by the deposition probability of the landing cell, the rest takes off again. As with the grains,
+sand still in the air after the last hop is lost. There is no random draw and every pass only writes the cells
+of its own rows, so the step is fully parallel and reproducible. Reptation is specific to the grains,
+avalanches are resolved by relaxation at the end of the step.
+*/
+void DuneSediment::SimulationStepFlux()
+{
+	if (fluxAirborne.SizeX() != nx || fluxAirborne.SizeY() != ny)
+	{
+		fluxAirborne = ScalarField2D(nx, ny, box, 0.0f);
+		fluxLanding = ScalarField2D(nx, ny, box, 0.0f);
+		fluxDeposition = ScalarField2D(nx, ny, box, 0.0f);
+	}
+
+	// Average number of grains lifted per cell: any cell with the grid budget, the cells covered with sediments otherwise
+	const int grains = PrepareGrainBudget();
+	float lifts = 1.0f;
+	if (grainBudget != GrainBudgetMode::Grid)
+		lifts = activeCells.empty() ? 0.0f : float(grains) / float(activeCells.size());
+	ScalarField2D& out = TransportedSediments();
+
+	// (1) Lift the sand, and evaluate the deposition probabilities on the terrain of the beginning of the step
+	std::vector<double> rows(nx);
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+	for (int i = 0; i < nx; i++)
+	{
+		const float* sand = sediments.Row(i);
+		const float* shadow = auxiliary.shadow.Row(i);
+		const float* plants = vegetation.Row(i);
+		float* air = fluxAirborne.Row(i);
+		float* deposition = fluxDeposition.Row(i);
+		float* o = out.Row(i);
+		double sum = 0.0;
+		for (int j = 0; j < ny; j++)
+		{
+			const float s = shadowOn ? shadow[j] : 0.0f;
+			const float v = vegetationOn ? plants[j] : 0.0f;
+
+			// A single draw decides the deposition of a grain: shadowed cells, then sandy (60%) or empty (40%) cells
+			deposition[j] = Math::Max(s, sand[j] > 0.0f ? 0.6f + 0.4f * v : 0.4f + 0.6f * v);
+			air[j] = Math::Min(lifts * matterToMove, Math::Max(sand[j], 0.0f)) * (1.0f - s) * (1.0f - v);
+			o[j] -= air[j];
+			sum += air[j];
+		}
+		rows[i] = sum;
+	}
+	double airborne = 0.0;
+	for (int i = 0; i < nx; i++)
+		airborne += rows[i];
+
+	// (2) Saltation hops
+	for (int bounce = 0; bounce < MAX_BOUNCE && airborne > 0.0; bounce++)
+	{
+		// The upwind gather is not exactly conservative when the wind varies, the landing sand is scaled to the sand in the air
+		const double landing = AdvectFlux();
+		const float scale = landing > 0.0 ? float(airborne / landing) : 0.0f;
+
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+		for (int i = 0; i < nx; i++)
+		{
+			const float* sand = sediments.Row(i);
+			const float* deposition = fluxDeposition.Row(i);
+			const float* land = fluxLanding.Row(i);
+			float* air = fluxAirborne.Row(i);
+			float* o = out.Row(i);
+			double sum = 0.0;
+			for (int j = 0; j < ny; j++)
+			{
+				const float a = scale * land[j];
+
+				// Abrasion by the expected number of grains landing on the cell, one in five of which abrades
+				if (abrasionOn && a > 0.0f && sand[j] < 0.5f)
+					PerformAbrasionOnCell(i, j, Vector2(auxiliary.windX.Row(i)[j], auxiliary.windY.Row(i)[j]), 0.2f * a / matterToMove);
+
+				o[j] += deposition[j] * a;
+				air[j] = (1.0f - deposition[j]) * a;
+				sum += air[j];
+			}
+			rows[i] = sum;
+		}
+		airborne = 0.0;
+		for (int i = 0; i < nx; i++)
+			airborne += rows[i];
+	}
+	out.RefreshGhosts(boundary);
+}
+
+/*!
+\brief Move the sand in the air by one saltation hop. Each cell gathers the sand lifted over the cell-sized footprint
+one hop upwind of it, which is the bilinear interpolation of the sand in the air at the upwind position.
+The gather is exact for a uniform wind, and lets every cell be written by a single thread.
+\return the total amount of sand landing, summed in a fixed order.
+*/
+double DuneSediment::AdvectFlux()
+{
+	std::vector<double> rows(nx);
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+	for (int i = 0; i < nx; i++)
+	{
+		const float* windX = auxiliary.windX.Row(i);
+		const float* windY = auxiliary.windY.Row(i);
+		float* land = fluxLanding.Row(i);
+		double sum = 0.0;
+		for (int j = 0; j < ny; j++)
+		{
+			// Upwind position in cells: rows follow the y axis of the world, columns the x axis
+			const float u = float(i) - windY[j] / cellSize;
+			const float v = float(j) - windX[j] / cellSize;
+			const float fu = floorf(u);
+			const float fv = floorf(v);
+			const float du = u - fu;
+			const float dv = v - fv;
+			const float* a = fluxAirborne.Row(ScalarField2D::GhostSource(int(fu), nx, boundary));
+			const float* b = fluxAirborne.Row(ScalarField2D::GhostSource(int(fu) + 1, nx, boundary));
+			const int ja = ScalarField2D::GhostSource(int(fv), ny, boundary);
+			const int jb = ScalarField2D::GhostSource(int(fv) + 1, ny, boundary);
+			land[j] = (1.0f - du) * ((1.0f - dv) * a[ja] + dv * a[jb]) + du * ((1.0f - dv) * b[ja] + dv * b[jb]);
+			sum += land[j];
+		}
+		rows[i] = sum;
+	}
+	double total = 0.0;
+	for (int i = 0; i < nx; i++)
+		total += rows[i];
+	return total;
+}
+
+/*!
+\brief Split the sand into grain size classes, or go back to a single class. Each cell stores the fractions of the
+classes in its active layer, the surface layer exchanging grains with the wind, packed as four halves: the
+grains update all the classes of a cell with a single atomic access. Grains lifted from a cell draw their class
+from its active layer, and the repose angle of the sand is the average of the classes weighted by the mix.
+The sand below the active layer is not tracked and is assumed to share its mix. Avalanches and reptation carry
+the mix of the cell the sand leaves, the relaxation and the flux engine move the sand as a single class.
+The mix is reset, and the edits can no longer be undone.
+\param classes grain size classes, at most four, or an empty list for a single class
+\param layer thickness of the active layer, in meter
+*/
+void DuneSediment::SetSedimentClasses(const std::vector<SedimentClass>& classes, float layer)
+{
+	if (int(classes.size()) > MaxSedimentClasses)
+		throw std::invalid_argument("DuneSediment: too many sediment classes");
+	sedimentClasses = classes;
+	activeLayer = Math::Max(layer, 1e-3f);
+	ClearHistory();
+	if (classes.empty())
+	{
+		sedimentMix = Half4Field2D();
+		return;
+	}
+	for (int c = 0; c < int(classes.size()); c++)
+		sedimentClassRepose[c] = tanf(ToRadians(classes[c].repose));
+	ResetSedimentMix();
+}
+
+/*!
+\brief Fill the active layer of every cell with the initial fractions of the sediment classes.
+*/
+void DuneSediment::ResetSedimentMix()
+{
+	float fractions[MaxSedimentClasses];
+	InitialSedimentFractions(fractions);
+	sedimentMix = Half4Field2D(nx, ny, box, Half4(fractions));
+}
+
+/*!
+\brief Compute the initial fractions of the sediment classes, normalized. They are also the mix of the sand
+added by the edits.
+\param fractions MaxSedimentClasses fractions
+*/
+void DuneSediment::InitialSedimentFractions(float* fractions) const
+{
+	float sum = 0.0f;
+	for (int c = 0; c < MaxSedimentClasses; c++)
+	{
+		fractions[c] = c < int(sedimentClasses.size()) ? Math::Max(sedimentClasses[c].fraction, 0.0f) : 0.0f;
+		sum += fractions[c];
+	}
+	for (int c = 0; c < MaxSedimentClasses; c++)
+		fractions[c] = sum > 0.0f ? fractions[c] / sum : (c == 0 ? 1.0f : 0.0f);
+}
+
+/*!
+\brief Draw the class of a grain lifted from a given cell, in proportion to the fractions of its active layer.
+*/
+int DuneSediment::DrawSedimentClass(int i, int j) const
+{
+	float f[MaxSedimentClasses];
+	sedimentMix.Get(i, j).ToFloats(f);
+	float u = Random::Uniform();
+	int c = 0;
+	while (c < int(sedimentClasses.size()) - 1 && u >= f[c])
+	{
+		u -= f[c];
+		c++;
+	}
+	return c;
+}
+
+/*!
+\brief Update the mix of the active layer of a cell gaining or losing sand, with a single atomic access to
+the packed fractions. Sand deposited on the cell is mixed into the active layer. Sand taken from the cell
+leaves the fractions of the rest of the active layer, which is replenished from below.
+Can be called concurrently from several threads. The height and the mix are separate atomic accesses: a grain may
+weight the mix with a height another grain is changing, which slightly skews the shares of the classes of the cell.
+The fractions stay positive and normalized, see TestSedimentMix().
+\param i, j cell
+\param height sediments of the cell before the change, in meter
+\param added fractions of the classes of the sand gained or lost
+\param mass amount of sand gained, negative for a loss, in meter
+*/
+void DuneSediment::MixSedimentClasses(int i, int j, float height, const float* added, float mass)
+{
+	const float h = Math::Max(height, 0.0f);
+	const float layer = Math::Min(h, activeLayer);
+
+	// Weights of the active layer and of the sand gained or lost
+	float a = 1.0f;
+	float b = 0.0f;
+	if (mass > 0.0f)
+	{
+		a = layer / (layer + mass);
+		b = mass / (layer + mass);
+	}
+	else if (h + mass >= activeLayer)
+	{
+		a = 1.0f - mass / activeLayer;
+		b = mass / activeLayer;
+	}
+	else if (h + mass > 1e-4f)
+	{
+		a = h / (h + mass);
+		b = mass / (h + mass);
+	}
+	else
+		return;
+
+	sedimentMix.FetchUpdate(sedimentMix.ToIndex1D(i, j), [a, b, added](Half4 mix)
+	{
+		float f[MaxSedimentClasses];
+		mix.ToFloats(f);
+		float sum = 0.0f;
+		for (int c = 0; c < MaxSedimentClasses; c++)
+		{
+			f[c] = Math::Max(a * f[c] + b * added[c], 0.0f);
+			sum += f[c];
+		}
+		if (sum <= 0.0f)
+			return mix;
+		for (int c = 0; c < MaxSedimentClasses; c++)
+			f[c] /= sum;
+		return Half4(f);
+	});
+}
@@ -0,0 +1,302 @@
+#include "desert.h"
+
+#include <cmath>
+#include <vector>
+#include <omp.h>
+
+// File scope variables
+#define OMP_NUM_THREAD 8
+
+// One level of the multigrid hierarchy of the wind solver, a cell centered grid.
+struct WindLevel
+{
+	int n, m;						//!< Grid resolution.
+	float h;						//!< Size of a cell, in meter.
+	std::vector<float> depth;		//!< Thickness of the air layer.
+	std::vector<float> phi;			//!< Velocity potential.
+	std::vector<float> rhs;			//!< Right-hand side.
+	std::vector<float> residual;	//!< Residual of the current solution.
+};
+
+/*!
+\brief Index of a neighbour of a coarse cell, -1 outside of a clamped domain. The potential is zero on the edges
+of a clamped domain: outside cells mirror the opposite of the potential of the cell inside, see WindPotential().
+*/
+static inline int WindNeighbour(const WindLevel& level, int i, int j, bool periodic)
+{
+	if (periodic)
+		return ((i + level.n) % level.n) * level.m + (j + level.m) % level.m;
+	if (i < 0 || i >= level.n || j < 0 || j >= level.m)
+		return -1;
+	return i * level.m + j;
+}
+
+/*!
+\brief Potential of a neighbour of a cell, given by WindNeighbour().
+*/
+static inline float WindPotential(const WindLevel& level, int neighbour, int cell)
+{
+	return neighbour < 0 ? -level.phi[cell] : level.phi[neighbour];
+}
+
+/*!
+\brief Conductance of the four faces of a cell, in the order +i, -i, +j, -j: mean thickness of the air layer on both sides.
+Faces on the edge of a clamped domain use the thickness of the cell.
+*/
+static inline void WindFaces(const WindLevel& level, int i, int j, bool periodic, int* id, float* a)
+{
+	static const int di[4] = { 1, -1, 0, 0 };
+	static const int dj[4] = { 0, 0, 1, -1 };
+	const float d = level.depth[i * level.m + j];
+	for (int k = 0; k < 4; k++)
+	{
+		id[k] = WindNeighbour(level, i + di[k], j + dj[k], periodic);
+		a[k] = 0.5f * (d + (id[k] < 0 ? d : level.depth[id[k]]));
+	}
+}
+
+/*!
+\brief Red-black Gauss-Seidel sweeps on the equation div(depth grad(phi)) = rhs. Cells of one color only read
+cells of the other color, so the rows of large levels are processed in parallel, unless an odd periodic level
+wraps two cells of the same color together.
+*/
+static void SmoothWind(WindLevel& level, int sweeps, bool periodic)
+{
+	const float h2 = level.h * level.h;
+	const bool parallel = level.n >= 64 && (!periodic || (level.n % 2 == 0 && level.m % 2 == 0));
+	for (int s = 0; s < sweeps; s++)
+	{
+		for (int color = 0; color < 2; color++)
+		{
+#pragma omp parallel for num_threads(OMP_NUM_THREAD) if (parallel)
+			for (int i = 0; i < level.n; i++)
+			{
+				int id[4];
+				float a[4];
+				for (int j = (i + color) % 2; j < level.m; j += 2)
+				{
+					WindFaces(level, i, j, periodic, id, a);
+					float sum = 0.0f;
+					float diagonal = 0.0f;
+					for (int k = 0; k < 4; k++)
+					{
+						sum += id[k] < 0 ? 0.0f : a[k] * level.phi[id[k]];
+						diagonal += id[k] < 0 ? 2.0f * a[k] : a[k];
+					}
+					level.phi[i * level.m + j] = (sum - h2 * level.rhs[i * level.m + j]) / diagonal;
+				}
+			}
+		}
+	}
+}
+
+/*!
+\brief Compute the residual of a level.
+\return the largest absolute residual.
+*/
+static float WindResidual(WindLevel& level, bool periodic)
+{
+	const float h2 = level.h * level.h;
+	float largest = 0.0f;
+	for (int i = 0; i < level.n; i++)
+	{
+		int id[4];
+		float a[4];
+		for (int j = 0; j < level.m; j++)
+		{
+			const int c = i * level.m + j;
+			WindFaces(level, i, j, periodic, id, a);
+			float flux = 0.0f;
+			for (int k = 0; k < 4; k++)
+				flux += a[k] * (WindPotential(level, id[k], c) - level.phi[c]);
+			level.residual[c] = level.rhs[c] - flux / h2;
+			largest = Math::Max(largest, std::abs(level.residual[c]));
+		}
+	}
+	return largest;
+}
+
+/*!
+\brief Multigrid V-cycle: smooth, solve the residual equation on the coarser level, correct with a bilinear interpolation, smooth.
+*/
+static void WindVCycle(std::vector<WindLevel>& levels, int l, bool periodic)
+{
+	WindLevel& fine = levels[l];
+	if (l == int(levels.size()) - 1)
+	{
+		SmoothWind(fine, 64, periodic);
+		return;
+	}
+	SmoothWind(fine, 2, periodic);
+	WindResidual(fine, periodic);
+
+	// Restriction: each coarse cell averages its four children
+	WindLevel& coarse = levels[l + 1];
+	for (int i = 0; i < coarse.n; i++)
+	{
+		for (int j = 0; j < coarse.m; j++)
+		{
+			const int c = (2 * i) * fine.m + 2 * j;
+			coarse.rhs[i * coarse.m + j] = 0.25f * (fine.residual[c] + fine.residual[c + 1] + fine.residual[c + fine.m] + fine.residual[c + fine.m + 1]);
+			coarse.phi[i * coarse.m + j] = 0.0f;
+		}
+	}
+	WindVCycle(levels, l + 1, periodic);
+
+	// Prolongation: each child interpolates its parent and the three nearest coarse cells, with weights 9, 3, 3 and 1 sixteenths
+	for (int i = 0; i < fine.n; i++)
+	{
+		const int ci = i / 2;
+		const int ni = ci + ((i % 2) == 0 ? -1 : 1);
+		for (int j = 0; j < fine.m; j++)
+		{
+			const int cj = j / 2;
+			const int nj = cj + ((j % 2) == 0 ? -1 : 1);
+			const int a = WindNeighbour(coarse, ci, cj, periodic);
+			const int b = WindNeighbour(coarse, ni, cj, periodic);
+			const int c = WindNeighbour(coarse, ci, nj, periodic);
+			const int d = WindNeighbour(coarse, ni, nj, periodic);
+			const float value = 9.0f * coarse.phi[a] + 3.0f * WindPotential(coarse, b, a) + 3.0f * WindPotential(coarse, c, a) + WindPotential(coarse, d, a);
+			fine.phi[i * fine.m + j] += value / 16.0f;
+		}
+	}
+	SmoothWind(fine, 2, periodic);
+}
+
+/*!
+\brief Solve the wind over a coarse grid of WindSolverStride² cells, as a potential flow in a shallow air layer.
+The layer is windLayerHeight thick above the mean terrain elevation: it thins over the crests and thickens over the
+troughs, and the flux of air through the layer is conserved, div(depth (wind + grad(phi))) = 0. The wind speeds up
+over the crests and goes around the high obstacles. The equation is solved by multigrid V-cycles starting from
+the previous potential, which amortizes the cost when the solution is refreshed every few steps.
+*/
+void DuneSediment::SolveWind()
+{
+	const bool periodic = boundary == BoundaryMode::Periodic;
+	const int n = (nx + WindSolverStride - 1) / WindSolverStride;
+	const int m = (ny + WindSolverStride - 1) / WindSolverStride;
+
+	// Hierarchy, coarsened while the resolution is even
+	std::vector<WindLevel> levels(1);
+	levels[0].n = n;
+	levels[0].m = m;
+	levels[0].h = cellSize * float(WindSolverStride);
+	while (levels.back().n % 2 == 0 && levels.back().m % 2 == 0 && levels.back().n >= 8 && levels.back().m >= 8)
+	{
+		WindLevel coarse;
+		coarse.n = levels.back().n / 2;
+		coarse.m = levels.back().m / 2;
+		coarse.h = 2.0f * levels.back().h;
+		levels.push_back(coarse);
+	}
+	for (int l = 0; l < int(levels.size()); l++)
+	{
+		const size_t size = size_t(levels[l].n) * size_t(levels[l].m);
+		levels[l].depth.assign(size, 0.0f);
+		levels[l].phi.assign(size, 0.0f);
+		levels[l].rhs.assign(size, 0.0f);
+		levels[l].residual.assign(size, 0.0f);
+	}
+
+	// Mean terrain elevation of the coarse cells
+	WindLevel& top = levels[0];
+	std::vector<double> rows(n);
+#pragma omp parallel for num_threads(OMP_NUM_THREAD)
+	for (int ci = 0; ci < n; ci++)
+	{
+		double sum = 0.0;
+		for (int cj = 0; cj < m; cj++)
+		{
+			double elevation = 0.0;
+			int cells = 0;
+			for (int i = ci * WindSolverStride; i < Math::Min((ci + 1) * WindSolverStride, nx); i++)
+			{
+				const float* rock = bedrock.Row(i);
+				const float* sand = sediments.Row(i);
+				for (int j = cj * WindSolverStride; j < Math::Min((cj + 1) * WindSolverStride, ny); j++)
+					elevation += rock[j] + sand[j];
+				cells += Math::Min((cj + 1) * WindSolverStride, ny) - cj * WindSolverStride;
+			}
+			top.depth[ci * m + cj] = float(elevation / cells);
+			sum += elevation / cells;
+		}
+		rows[ci] = sum;
+	}
+	double mean = 0.0;
+	for (int ci = 0; ci < n; ci++)
+		mean += rows[ci];
+	mean /= double(n) * double(m);
+
+	// Thickness of the layer, a fraction of it remains over the highest peaks
+	for (int c = 0; c < n * m; c++)
+		top.depth[c] = Math::Max(windLayerHeight + float(mean) - top.depth[c], 0.1f * windLayerHeight);
+	for (int l = 1; l < int(levels.size()); l++)
+	{
+		const WindLevel& fine = levels[l - 1];
+		WindLevel& coarse = levels[l];
+		for (int i = 0; i < coarse.n; i++)
+		{
+			for (int j = 0; j < coarse.m; j++)
+			{
+				const int c = (2 * i) * fine.m + 2 * j;
+				coarse.depth[i * coarse.m + j] = 0.25f * (fine.depth[c] + fine.depth[c + 1] + fine.depth[c + fine.m] + fine.depth[c + fine.m + 1]);
+			}
+		}
+	}
+
+	// Divergence of the flux of the base wind through the layer, rows follow the y axis of the world
+	const float ui[4] = { wind.y, -wind.y, wind.x, -wind.x };
+	float scale = 0.0f;
+	for (int i = 0; i < n; i++)
+	{
+		int id[4];
+		float a[4];
+		for (int j = 0; j < m; j++)
+		{
+			WindFaces(top, i, j, periodic, id, a);
+			float flux = 0.0f;
+			for (int k = 0; k < 4; k++)
+				flux += a[k] * ui[k];
+			top.rhs[i * m + j] = -flux / top.h;
+			scale = Math::Max(scale, std::abs(top.rhs[i * m + j]));
+		}
+	}
+
+	// V-cycles from the previous potential
+	if (int(windPotential.size()) == n * m)
+		top.phi = windPotential;
+	for (int cycle = 0; cycle < 10 && WindResidual(top, periodic) > 1e-3f * scale; cycle++)
+	{
+		WindVCycle(levels, 0, periodic);
+
+		// The periodic potential is defined up to a constant
+		if (periodic)
+		{
+			double average = 0.0;
+			for (int c = 0; c < n * m; c++)
+				average += top.phi[c];
+			average /= double(n) * double(m);
+			for (int c = 0; c < n * m; c++)
+				top.phi[c] -= float(average);
+		}
+	}
+	windPotential = top.phi;
+
+	// Wind of the coarse cells
+	if (solvedWindX.SizeX() != n || solvedWindX.SizeY() != m)
+	{
+		solvedWindX = ScalarField2D(n, m, box, 0.0f);
+		solvedWindY = ScalarField2D(n, m, box, 0.0f);
+	}
+	for (int i = 0; i < n; i++)
+	{
+		for (int j = 0; j < m; j++)
+		{
+			const int c = i * m + j;
+			const float gi = (WindPotential(top, WindNeighbour(top, i + 1, j, periodic), c) - WindPotential(top, WindNeighbour(top, i - 1, j, periodic), c)) / (2.0f * top.h);
+			const float gj = (WindPotential(top, WindNeighbour(top, i, j + 1, periodic), c) - WindPotential(top, WindNeighbour(top, i, j - 1, periodic), c)) / (2.0f * top.h);
+			solvedWindX.Set(i, j, wind.x + gj);
+			solvedWindY.Set(i, j, wind.y + gi);
+		}
+	}
+}
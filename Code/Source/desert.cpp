@@ -16,9 +16,9 @@ DuneSediment::DuneSediment() {
   box = Box2D(Vector2(0), 1);
   wind = Vector2(1, 0);
 
-  bedrock = ScalarField2D(nx, ny, box, 0.0);
-  vegetation = ScalarField2D(nx, ny, box, 0.0);
-  sediments = ScalarField2D(nx, ny, box, 0.0);
+  bedrock = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ 1 });
+  vegetation = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ 1 });
+  sediments = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ 1 });
 
   matterToMove = 0.1f;
   Vector2 celldiagonal =
@@ -27,6 +27,10 @@ DuneSediment::DuneSediment() {
   cellSize = Box2D(box.BottomLeft(), box.BottomLeft() + celldiagonal)
                  .Size()
                  .x; // We only consider squared heightfields
+
+  ResetAbradedCells();
+  ResetSleepingTiles();
+  RefreshGhostCells();
 }
 
 /*!
@@ -45,9 +49,9 @@ DuneSediment::DuneSediment(const Box2D &bbox, float rMin, float rMax,
   std::mt19937_64 gen(0);
   std::uniform_real_distribution<float> uniformSand(rMin, rMax);
 
-  bedrock = ScalarField2D(nx, ny, box, 0.0);
-  vegetation = ScalarField2D(nx, ny, box, 0.0);
-  sediments = ScalarField2D(nx, ny, box, 0.0);
+  bedrock = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ 1 });
+  vegetation = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ 1 });
+  sediments = ScalarField2D(nx, ny, box, 0.0f, GhostBorder{ 1 });
   for (int i = 0; i < nx; i++) {
     for (int j = 0; j < ny; j++) {
       Vector2 p = bedrock.ArrayVertex(i, j);
@@ -77,6 +81,10 @@ DuneSediment::DuneSediment(const Box2D &bbox, float rMin, float rMax,
                  .x; // We only consider squared heightfields
 
   matterToMove = 0.1f;
+
+  ResetAbradedCells();
+  ResetSleepingTiles();
+  RefreshGhostCells();
 }
 
 /*!
@@ -94,17 +102,22 @@ void DuneSediment::ExportObj(const std::string &url) const {
   std::vector<Vector3> normals;
   std::vector<int> indices;
 
+  // Results are expressed in the world frame
+  ScalarField2D rock, sand;
+  WorldFields(rock, sand);
+
   // Vertices & UVs & Normals
   normals.resize(nx * ny, Vector3(0));
   vertices.resize(nx * ny, Vector3(0));
   for (int i = 0; i < nx; i++) {
     for (int j = 0; j < ny; j++) {
-      int id = ToIndex1D(i, j);
+      int id = i * nx + j;
       normals[id] =
-          -Normalize(Vector2(bedrock.Gradient(i, j) + sediments.Gradient(i, j))
+          -Normalize(Vector2(rock.Gradient(i, j) + sand.Gradient(i, j))
                          .ToVector3(-2.0f));
       vertices[id] = Vector3(
-          box[0][0] + i * (box[1][0] - box[0][0]) / (nx - 1), Height(i, j),
+          box[0][0] + i * (box[1][0] - box[0][0]) / (nx - 1),
+          rock.Get(i, j) + sand.Get(i, j),
           box[0][1] + j * (box[1][1] - box[0][1]) / (ny - 1));
     }
   }
@@ -11,15 +11,68 @@
 
 #define _CRT_SECURE_NO_WARNINGS
 
+#include "benchmark.h"
 #include "desert.h"
+#include "tests.h"
 
 #include <sstream>
 
+/*!
+\brief Micro-benchmarks of the simulation kernels, run with the "benchmark"
+argument.
+*/
+static void RunBenchmarks() {
+  DuneSediment dune =
+      DuneSediment(Box2D(Vector2(0), Vector2(1024)), 3.0, 5.0, Vector2(0, 3));
+  BenchmarkFlowDirections(dune);
+  BenchmarkFieldAccess(dune);
+  BenchmarkHeightSampler(dune);
+  BenchmarkAvalanches(dune, 3);
+  BenchmarkExecution(dune, 3);
+  BenchmarkStepMode(dune, 3);
+  BenchmarkAuxiliaryMode(dune, 3);
+  BenchmarkWindAlignment(dune, 3);
+  BenchmarkGrainBudget(dune, 3);
+  BenchmarkLiftOrder(dune, 3);
+  BenchmarkLiftSampling(dune, 5, 0.1f);
+  BenchmarkSnapshots(dune, 2);
+  BenchmarkEditHistory(dune, 200);
+  BenchmarkTransportEngine(dune, 3);
+  BenchmarkWindSolver(dune, 3);
+  BenchmarkRepose(dune, 3);
+  BenchmarkSedimentClasses(dune, 3);
+
+  // Abrasion needs a low sand supply
+  DuneSediment yardangs =
+      DuneSediment(Box2D(Vector2(0), Vector2(1024)), 0.5, 0.5, Vector2(6, 0));
+  BenchmarkBedrockStabilization(yardangs, 5);
+  BenchmarkTurbulence(yardangs, 3);
+
+  // Sleeping tiles need quiet regions: bare ground next to a sand sheet
+  DuneSediment patch =
+      DuneSediment(Box2D(Vector2(0), Vector2(1024)), 0.5, 2.0, Vector2(0, 5));
+  patch.Edit("bare ground", Box2D(Vector2(0), Vector2(600, 1024)),
+             [](const Vector2 &, float &, float &sand, float &) { sand = 0.0f; });
+  BenchmarkSleepingTiles(patch, 15);
+}
+
 /*!
 \brief Running this program will export some
 meshes similar to the ones seen in the paper.
 */
-int main() {
+int main(int argc, char **argv) {
+  if (argc > 1 && std::string(argv[1]) == "benchmark") {
+    RunBenchmarks();
+    return 0;
+  }
+  if (argc > 1 && std::string(argv[1]) == "test") {
+    bool passed = TestGhostRefresh();
+    passed = TestMassConservation() && passed;
+    passed = TestSedimentMix() && passed;
+    passed = TestSnapshotRestore() && passed;
+    return passed ? 0 : 1;
+  }
+
   // Transverse dunes are created under unimodal wind, as well as medium to high
   // sand supply. They are basically the default dune type obtained by any basic
   // simulation scenario.
@@ -30,15 +83,16 @@ int main() {
   const int numSteps = 300;
   // Initial
   dune.ExportJPG("transverse_0.jpg");
-  for (int i = 1; i <= numSteps; i++) {
+  dune.AddPeriodicTask(
+      "export", 100, 1, [numSteps](DuneSediment &d, int, int) {
+        std::ostringstream ossFilename;
+        ossFilename << "transverse_" << d.StepCount() << ".jpg";
+        d.ExportJPG(ossFilename.str());
+        std::cout << "\r" << float(d.StepCount()) / numSteps * 100
+                  << "\% done!";
+      });
+  for (int i = 1; i <= numSteps; i++)
     dune.SimulationStepMultiThreadAtomic();
-    if ((i % 100) == 0) {
-      std::ostringstream ossFilename;
-      ossFilename << "transverse_" << i << ".jpg";
-      dune.ExportJPG(ossFilename.str());
-      std::cout << "\r" << float(i) / numSteps * 100 << "\% done!";
-    }
-  }
   std::cout << "\n" << std::endl;
 
   //   // Barchan dunes appears under similar wind conditions, but lower sand
@@ -13,8 +13,9 @@ solution "Desertscape"
 
 	configuration "linux"
 		buildoptions { "-mtune=native -march=native" }
-		buildoptions { "-std=c++14" }
+		buildoptions { "-std=c++20" }
 		buildoptions { "-w" }
+		buildoptions { "-fopenmp" }
 		buildoptions { "-flto -g"}
 		linkoptions { "-fopenmp" }
 		linkoptions { "-flto"}